@@ -860,10 +860,24 @@ static void lg_remove(struct hid_device *hdev)
 	struct lg_drv_data *drv_data = hid_get_drvdata(hdev);
 	if (drv_data->quirks & LG_FF4)
 		lg4ff_deinit(hdev);
+	else if (drv_data->quirks & (LG_FF | LG_FF2 | LG_FF3))
+		lgff_core_stop(hdev);
 	hid_hw_stop(hdev);
 	kfree(drv_data);
 }
 
+#ifdef CONFIG_PM
+static int lg_resume(struct hid_device *hdev)
+{
+	struct lg_drv_data *drv_data = hid_get_drvdata(hdev);
+
+	if (drv_data->quirks & LG_FF4)
+		return lg4ff_resume(hdev);
+
+	return 0;
+}
+#endif
+
 static const struct hid_device_id lg_devices[] = {
 	{ HID_USB_DEVICE(USB_VENDOR_ID_LOGITECH, USB_DEVICE_ID_S510_RECEIVER),
 		.driver_data = LG_RDESC | LG_WIRELESS },
@@ -945,6 +959,10 @@ static struct hid_driver lg_driver = {
 	.raw_event = lg_raw_event,
 	.probe = lg_probe,
 	.remove = lg_remove,
+#ifdef CONFIG_PM
+	.resume = lg_resume,
+	.reset_resume = lg_resume,
+#endif
 };
 module_hid_driver(lg_driver);
 
@@ -7,6 +7,12 @@ struct lg_drv_data {
 	void *device_props;	/* Device specific properties */
 };
 
+#if defined(CONFIG_LOGITECH_FF) || defined(CONFIG_LOGIRUMBLEPAD2_FF) || defined(CONFIG_LOGIG940_FF)
+void lgff_core_stop(struct hid_device *hdev);
+#else
+static inline void lgff_core_stop(struct hid_device *hdev) { }
+#endif
+
 #ifdef CONFIG_LOGITECH_FF
 int lgff_init(struct hid_device *hdev);
 #else
@@ -14,16 +14,13 @@
 #include <linux/hid.h>
 
 #include "hid-lg.h"
-
-struct lg2ff_device {
-	struct hid_report *report;
-};
+#include "hid-lgff-core.h"
 
 static int play_effect(struct input_dev *dev, void *data,
 			 struct ff_effect *effect)
 {
-	struct hid_device *hid = input_get_drvdata(dev);
-	struct lg2ff_device *lg2ff = data;
+	struct lgff_core *core = data;
+	s32 value[LGFF_CORE_VALUES] = { 0 };
 	int weak, strong;
 
 	strong = effect->u.rumble.strong_magnitude;
@@ -33,25 +30,26 @@ static int play_effect(struct input_dev *dev, void *data,
 		weak = weak * 0xff / 0xffff;
 		strong = strong * 0xff / 0xffff;
 
-		lg2ff->report->field[0]->value[0] = 0x51;
-		lg2ff->report->field[0]->value[2] = weak;
-		lg2ff->report->field[0]->value[4] = strong;
+		value[0] = 0x51;
+		value[2] = weak;
+		value[4] = strong;
 	} else {
-		lg2ff->report->field[0]->value[0] = 0xf3;
-		lg2ff->report->field[0]->value[2] = 0x00;
-		lg2ff->report->field[0]->value[4] = 0x00;
+		value[0] = 0xf3;
+		value[2] = 0x00;
+		value[4] = 0x00;
 	}
 
-	hid_hw_request(hid, lg2ff->report, HID_REQ_SET_REPORT);
+	lgff_core_submit(core, LGFF_CORE_EFFECT, value);
 	return 0;
 }
 
 int lg2ff_init(struct hid_device *hid)
 {
-	struct lg2ff_device *lg2ff;
+	struct lgff_core *core;
 	struct hid_report *report;
 	struct hid_input *hidinput;
 	struct input_dev *dev;
+	s32 value[LGFF_CORE_VALUES] = { 0 };
 	int error;
 
 	if (list_empty(&hid->inputs)) {
@@ -66,28 +64,24 @@ int lg2ff_init(struct hid_device *hid)
 	if (!report)
 		return -ENODEV;
 
-	lg2ff = kmalloc(sizeof(struct lg2ff_device), GFP_KERNEL);
-	if (!lg2ff)
+	core = kzalloc(sizeof(struct lgff_core), GFP_KERNEL);
+	if (!core)
 		return -ENOMEM;
 
 	set_bit(FF_RUMBLE, dev->ffbit);
 
-	error = input_ff_create_memless(dev, lg2ff, play_effect);
+	lgff_core_init(core, hid, report);
+
+	error = input_ff_create_memless(dev, core, play_effect);
 	if (error) {
-		kfree(lg2ff);
+		lgff_core_stop(hid);
+		kfree(core);
 		return error;
 	}
 
-	lg2ff->report = report;
-	report->field[0]->value[0] = 0xf3;
-	report->field[0]->value[1] = 0x00;
-	report->field[0]->value[2] = 0x00;
-	report->field[0]->value[3] = 0x00;
-	report->field[0]->value[4] = 0x00;
-	report->field[0]->value[5] = 0x00;
-	report->field[0]->value[6] = 0x00;
-
-	hid_hw_request(hid, report, HID_REQ_SET_REPORT);
+	/* Stop the motors */
+	value[0] = 0xf3;
+	lgff_core_submit(core, LGFF_CORE_EFFECT, value);
 
 	hid_info(hid, "Force feedback for Logitech variant 2 rumble devices by Anssi Hannula <anssi.hannula@gmail.com>\n");
 
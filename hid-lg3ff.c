@@ -10,9 +10,11 @@
 
 
 #include <linux/input.h>
+#include <linux/slab.h>
 #include <linux/hid.h>
 
 #include "hid-lg.h"
+#include "hid-lgff-core.h"
 
 /*
  * G940 Theory of Operation (from experimentation)
@@ -41,24 +43,17 @@
  * I'm sure these are effects that I don't know enough about them
  */
 
-struct lg3ff_device {
-	struct hid_report *report;
-};
-
 static int hid_lg3ff_play(struct input_dev *dev, void *data,
 			 struct ff_effect *effect)
 {
-	struct hid_device *hid = input_get_drvdata(dev);
-	struct list_head *report_list = &hid->report_enum[HID_OUTPUT_REPORT].report_list;
-	struct hid_report *report = list_entry(report_list->next, struct hid_report, list);
+	struct lgff_core *core = data;
+	s32 value[LGFF_CORE_VALUES] = { 0 };
 	int x, y;
 
 /*
  * Available values in the field should always be 63, but we only use up to
- * 35. Instead, clear the entire area, however big it is.
+ * 35. The rest are sent cleared.
  */
-	memset(report->field[0]->value, 0,
-	       sizeof(__s32) * report->field[0]->report_count);
 
 	switch (effect->type) {
 	case FF_CONSTANT:
@@ -70,16 +65,16 @@ static int hid_lg3ff_play(struct input_dev *dev, void *data,
 		y = effect->u.ramp.end_level;
 
 		/* send command byte */
-		report->field[0]->value[0] = 0x51;
+		value[0] = 0x51;
 
 /*
  * Sign backwards from other Force3d pro
  * which get recast here in two's complement 8 bits
  */
-		report->field[0]->value[1] = (unsigned char)(-x);
-		report->field[0]->value[31] = (unsigned char)(-y);
+		value[1] = (unsigned char)(-x);
+		value[31] = (unsigned char)(-y);
 
-		hid_hw_request(hid, report, HID_REQ_SET_REPORT);
+		lgff_core_submit(core, LGFF_CORE_EFFECT, value);
 		break;
 	}
 	return 0;
@@ -87,25 +82,30 @@ static int hid_lg3ff_play(struct input_dev *dev, void *data,
 static void hid_lg3ff_set_autocenter(struct input_dev *dev, u16 magnitude)
 {
 	struct hid_device *hid = input_get_drvdata(dev);
-	struct list_head *report_list = &hid->report_enum[HID_OUTPUT_REPORT].report_list;
-	struct hid_report *report = list_entry(report_list->next, struct hid_report, list);
+	struct lg_drv_data *drv_data = hid_get_drvdata(hid);
+	struct lgff_core *core = drv_data->device_props;
+	s32 value[LGFF_CORE_VALUES] = { 0 };
+
+	if (!core)
+		return;
 
 /*
  * Auto Centering probed from device
  * NOTE: deadman's switch on G940 must be covered
  * for effects to work
  */
-	report->field[0]->value[0] = 0x51;
-	report->field[0]->value[1] = 0x00;
-	report->field[0]->value[2] = 0x00;
-	report->field[0]->value[3] = 0x7F;
-	report->field[0]->value[4] = 0x7F;
-	report->field[0]->value[31] = 0x00;
-	report->field[0]->value[32] = 0x00;
-	report->field[0]->value[33] = 0x7F;
-	report->field[0]->value[34] = 0x7F;
-
-	hid_hw_request(hid, report, HID_REQ_SET_REPORT);
+	value[0] = 0x51;
+	value[1] = 0x00;
+	value[2] = 0x00;
+	value[3] = 0x7F;
+	value[4] = 0x7F;
+	value[31] = 0x00;
+	value[32] = 0x00;
+	value[33] = 0x7F;
+	value[34] = 0x7F;
+
+	/* Same full state command as the effects, the latest one wins */
+	lgff_core_submit(core, LGFF_CORE_EFFECT, value);
 }
 
 
@@ -117,6 +117,8 @@ static const signed short ff3_joystick_ac[] = {
 
 int lg3ff_init(struct hid_device *hid)
 {
+	struct lgff_core *core;
+	struct hid_report *report;
 	struct hid_input *hidinput;
 	struct input_dev *dev;
 	const signed short *ff_bits = ff3_joystick_ac;
@@ -131,16 +133,26 @@ int lg3ff_init(struct hid_device *hid)
 	dev = hidinput->input;
 
 	/* Check that the report looks ok */
-	if (!hid_validate_values(hid, HID_OUTPUT_REPORT, 0, 0, 35))
+	report = hid_validate_values(hid, HID_OUTPUT_REPORT, 0, 0, 35);
+	if (!report)
 		return -ENODEV;
 
 	/* Assume single fixed device G940 */
 	for (i = 0; ff_bits[i] >= 0; i++)
 		set_bit(ff_bits[i], dev->ffbit);
 
-	error = input_ff_create_memless(dev, NULL, hid_lg3ff_play);
-	if (error)
+	core = kzalloc(sizeof(struct lgff_core), GFP_KERNEL);
+	if (!core)
+		return -ENOMEM;
+
+	lgff_core_init(core, hid, report);
+
+	error = input_ff_create_memless(dev, core, hid_lg3ff_play);
+	if (error) {
+		lgff_core_stop(hid);
+		kfree(core);
 		return error;
+	}
 
 	if (test_bit(FF_AUTOCENTER, dev->ffbit))
 		dev->ff->set_autocenter = hid_lg3ff_set_autocenter;
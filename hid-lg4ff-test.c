@@ -0,0 +1,707 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *  KUnit tests for the force feedback of the Logitech Gaming Wheels
+ *
+ *  The driver code is built again into this module so that the tests can
+ *  reach its static functions. The tracepoints stay in the driver module.
+ */
+
+#include <kunit/test.h>
+#include <linux/kernel_read_file.h>
+
+#define NOTRACE
+#include "hid-lg4ff.c"
+
+/* From hid-lg.c, which isn't part of this module */
+int lg4ff_no_autoswitch;
+
+#define LG4FF_TEST_TOLERANCE 64
+#define LG4FF_TEST_SAMPLES 1000
+#define LG4FF_TEST_OPS 10000
+#define LG4FF_TEST_START 1000000
+#define LG4FF_TEST_STEP 997
+
+struct lg4ff_test_effect {
+	const char *name;
+	u16 type;
+	u16 waveform;
+	int id;
+};
+
+static const u16 lg4ff_test_waveforms[] = {FF_SINE, FF_SQUARE, FF_TRIANGLE, FF_SAW_UP, FF_SAW_DOWN};
+
+/* Keeps the timed results alive */
+static int lg4ff_test_sink;
+
+static void lg4ff_test_effect(struct ff_effect *effect, int id, u16 type, u16 waveform)
+{
+	memset(effect, 0, sizeof(*effect));
+	effect->id = id;
+	effect->type = type;
+	effect->direction = 0x4000;
+
+	switch (type) {
+		case FF_CONSTANT:
+			effect->replay.length = 1000;
+			effect->u.constant.level = 0x6000;
+			effect->u.constant.envelope.attack_length = 200;
+			effect->u.constant.envelope.attack_level = 0x1000;
+			effect->u.constant.envelope.fade_length = 300;
+			effect->u.constant.envelope.fade_level = 0x800;
+			break;
+		case FF_RAMP:
+			effect->replay.length = 1000;
+			effect->u.ramp.start_level = -0x7000;
+			effect->u.ramp.end_level = 0x5000;
+			break;
+		case FF_PERIODIC:
+			effect->u.periodic.waveform = waveform;
+			effect->u.periodic.period = 100 + id;
+			effect->u.periodic.magnitude = 0x5000;
+			effect->u.periodic.offset = 0x400;
+			effect->u.periodic.phase = 25;
+			break;
+		default:
+			effect->u.condition[0].right_saturation = 0xc000;
+			effect->u.condition[0].left_saturation = 0xc000;
+			effect->u.condition[0].right_coeff = 0x3000 + id;
+			effect->u.condition[0].left_coeff = 0x3000 + id;
+			effect->u.condition[1] = effect->u.condition[0];
+			break;
+	}
+}
+
+/* Level the effect should have t us after it started, computed the long way */
+static int lg4ff_test_reference(const struct ff_effect *effect, unsigned long t)
+{
+	const struct ff_envelope *envelope;
+	unsigned long length = MS2US(effect->replay.length);
+	unsigned long period;
+	long attack_length, fade_length;
+	int level, attack_level, fade_level;
+	unsigned int phase;
+	int value;
+
+	switch (effect->type) {
+		case FF_CONSTANT:
+			envelope = &effect->u.constant.envelope;
+			level = effect->u.constant.level;
+			attack_length = MS2US(envelope->attack_length);
+			fade_length = MS2US(envelope->fade_length);
+			attack_level = level < 0 ? -envelope->attack_level : envelope->attack_level;
+			fade_level = level < 0 ? -envelope->fade_level : envelope->fade_level;
+			if ((long)t < attack_length) {
+				return attack_level + div_s64((s64)(level - attack_level) * (long)t, attack_length);
+			}
+			if ((long)t >= (long)length - fade_length) {
+				return level - div_s64((s64)(level - fade_level) * ((long)t - ((long)length - fade_length)), fade_length);
+			}
+			return level;
+		case FF_RAMP:
+			return effect->u.ramp.start_level + div_s64((s64)(effect->u.ramp.end_level - effect->u.ramp.start_level) * (long)t, length);
+		case FF_PERIODIC:
+			period = MS2US(effect->u.periodic.period);
+			phase = div_u64(((u64)t + MS2US(effect->u.periodic.phase)) * 0x10000, period) & 0xffff;
+			switch (effect->u.periodic.waveform) {
+				case FF_SINE:
+					value = fixp_sin32_rad(phase, 0x10000) >> 16;
+					break;
+				case FF_SQUARE:
+					value = phase < 0x8000 ? 0x7fff : -0x7fff;
+					break;
+				case FF_TRIANGLE:
+					value = abs((int)phase - 0x8000) * 2 - 0x8000;
+					break;
+				default:
+					value = (int)phase - 0x8000;
+					break;
+			}
+			if (effect->u.periodic.waveform == FF_SAW_DOWN) {
+				value = -value;
+			}
+			return effect->u.periodic.offset + ((effect->u.periodic.magnitude * value) >> 15);
+	}
+
+	return 0;
+}
+
+static __always_inline int lg4ff_test_calculate(struct lg4ff_effect_state *state)
+{
+	switch (state->effect->type) {
+		case FF_CONSTANT:
+			return lg4ff_calculate_constant(state);
+		case FF_RAMP:
+			return lg4ff_calculate_ramp(state);
+		case FF_PERIODIC:
+			return lg4ff_calculate_periodic(state);
+	}
+
+	return 0;
+}
+
+static const struct lg4ff_test_effect lg4ff_test_curves[] = {
+	{ "constant", FF_CONSTANT, 0 },
+	{ "ramp", FF_RAMP, 0 },
+	{ "sine", FF_PERIODIC, FF_SINE },
+	{ "square", FF_PERIODIC, FF_SQUARE },
+	{ "triangle", FF_PERIODIC, FF_TRIANGLE },
+	{ "saw_up", FF_PERIODIC, FF_SAW_UP },
+	{ "saw_down", FF_PERIODIC, FF_SAW_DOWN },
+};
+
+static const struct lg4ff_test_effect lg4ff_test_slots[] = {
+	{ "constant", FF_CONSTANT, 0, 0 },
+	{ "spring", FF_SPRING, 0, 1 },
+	{ "damper", FF_DAMPER, 0, 2 },
+	{ "friction", FF_FRICTION, 0, 3 },
+};
+
+static void lg4ff_test_desc(const struct lg4ff_test_effect *effect, char *desc)
+{
+	strscpy(desc, effect->name, KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(lg4ff_test_curves, lg4ff_test_curves, lg4ff_test_desc);
+KUNIT_ARRAY_PARAM(lg4ff_test_slots, lg4ff_test_slots, lg4ff_test_desc);
+
+/* Check one effect against its reference curve and time its evaluation */
+static void lg4ff_test_curve(struct kunit *test)
+{
+	const struct lg4ff_test_effect *param = test->param_value;
+	struct lg4ff_device_entry *entry = test->priv;
+	struct lg4ff_effect_state *state = &entry->states[0];
+	struct ff_effect effect;
+	unsigned long t, worst = 0;
+	int error, max_error = 0;
+	int sum = 0;
+	u64 start, ns;
+	int i;
+
+	lg4ff_test_effect(&effect, 0, param->type, param->waveform);
+	/* Exact waveforms, too long for the band-limited tables */
+	if (param->type == FF_PERIODIC) {
+		effect.u.periodic.period = 1000;
+	}
+	lg4ff_publish_effect(entry, &effect, LG4FF_TEST_START);
+	lg4ff_play_state(entry, 0, 1, LG4FF_TEST_START);
+
+	for (i = 0; i < LG4FF_TEST_SAMPLES; i++) {
+		t = i * LG4FF_TEST_STEP;
+		if (effect.replay.length && t >= MS2US(effect.replay.length)) {
+			break;
+		}
+		lg4ff_update_state(state, LG4FF_TEST_START + t);
+		error = abs(lg4ff_test_calculate(state) - lg4ff_test_reference(&effect, t));
+		if (error > max_error) {
+			max_error = error;
+			worst = t;
+		}
+	}
+	KUNIT_EXPECT_LE_MSG(test, max_error, LG4FF_TEST_TOLERANCE, "worst at %lu us", worst);
+
+	start = ktime_get_ns();
+	for (i = 0; i < LG4FF_TEST_OPS; i++) {
+		lg4ff_update_state(state, LG4FF_TEST_START + (i & 511) * LG4FF_TEST_STEP);
+		sum += lg4ff_test_calculate(state);
+	}
+	ns = ktime_get_ns() - start;
+	WRITE_ONCE(lg4ff_test_sink, sum);
+
+	kunit_info(test, "%s: max_error %d ns_per_op %llu\n", param->name, max_error, div_u64(ns, LG4FF_TEST_OPS));
+}
+
+/* Time the slot encoder with parameters changing on every call */
+static void lg4ff_test_slot(struct kunit *test)
+{
+	const struct lg4ff_test_effect *param = test->param_value;
+	struct lg4ff_effect_parameters parameters[2];
+	struct lg4ff_slot slot;
+	u64 start, ns;
+	int changed = 0;
+	int i;
+
+	memset(&slot, 0, sizeof(slot));
+	memset(parameters, 0, sizeof(parameters));
+	slot.id = param->id;
+	slot.effect_type = param->type;
+	for (i = 0; i < 2; i++) {
+		parameters[i].level = 0x1000 << i;
+		parameters[i].k1 = 0x2000 << i;
+		parameters[i].k2 = -(0x1000 << i);
+		parameters[i].d1 = -(0x800 << i);
+		parameters[i].d2 = 0x800 << i;
+		parameters[i].clip = 0x4000 << i;
+	}
+
+	start = ktime_get_ns();
+	for (i = 0; i < LG4FF_TEST_OPS; i++) {
+		changed += lg4ff_update_slot(&slot, &parameters[i & 1]);
+		slot.is_updated = 0;
+	}
+	ns = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, changed, LG4FF_TEST_OPS);
+	KUNIT_EXPECT_EQ(test, slot.current_cmd[0], (0x10 << param->id) + 0xc);
+
+	kunit_info(test, "slot_%s: ns_per_op %llu\n", param->name, div_u64(ns, LG4FF_TEST_OPS));
+}
+
+/* Commands of freshly reset slots, the constant force at the center and
+ * the conditions stopped */
+static void lg4ff_test_slot_reset(struct kunit *test)
+{
+	struct lg4ff_device_entry *entry = test->priv;
+	static const u8 expected[4][7] = {
+		{ 0x11, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00 },
+		{ 0x23, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+		{ 0x43, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+		{ 0x83, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+	};
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		KUNIT_EXPECT_MEMEQ(test, entry->slots[i].current_cmd, expected[i], 7);
+		KUNIT_EXPECT_TRUE(test, entry->slots[i].is_updated);
+	}
+}
+
+/* A tick mixing 16 effects of all kinds into the four slots */
+static void lg4ff_test_tick(struct kunit *test)
+{
+	static const u16 types[16] = {
+		FF_CONSTANT, FF_CONSTANT, FF_CONSTANT, FF_CONSTANT,
+		FF_RAMP, FF_RAMP,
+		FF_PERIODIC, FF_PERIODIC, FF_PERIODIC, FF_PERIODIC, FF_PERIODIC,
+		FF_SPRING, FF_SPRING, FF_DAMPER, FF_DAMPER, FF_FRICTION
+	};
+	struct lg4ff_device_entry *entry = test->priv;
+	struct lg4ff_effect_parameters parameters[4];
+	struct ff_effect effect;
+	unsigned long now = LG4FF_TEST_START;
+	u64 start, ns;
+	int i, j;
+
+	for (i = 0; i < 16; i++) {
+		lg4ff_test_effect(&effect, i, types[i], lg4ff_test_waveforms[i % ARRAY_SIZE(lg4ff_test_waveforms)]);
+		/* Keep them all playing */
+		effect.replay.length = 0;
+		lg4ff_publish_effect(entry, &effect, now);
+		lg4ff_play_state(entry, i, 1, now);
+	}
+	KUNIT_ASSERT_EQ(test, entry->effects_used, 16);
+
+	start = ktime_get_ns();
+	for (i = 0; i < LG4FF_TEST_OPS; i++) {
+		now += entry->rate.period;
+		lg4ff_mix_effects(entry, parameters, now);
+		for (j = 0; j < 4; j++) {
+			lg4ff_update_slot(&entry->slots[j], &parameters[j]);
+			entry->slots[j].is_updated = 0;
+		}
+	}
+	ns = ktime_get_ns() - start;
+
+	/* Every slot is busy after the mix */
+	for (j = 0; j < 4; j++) {
+		KUNIT_EXPECT_NE(test, entry->slots[j].current_cmd[0] & 0xf, 3);
+	}
+
+	kunit_info(test, "tick_16: ns_per_tick %llu\n", div_u64(ns, LG4FF_TEST_OPS));
+}
+
+#ifdef CONFIG_DEBUG_FS
+#define LG4FF_TEST_REPLAY_TICKS 1000000
+#define LG4FF_TEST_CAPTURE_MAX (LG4FF_CAPTURE_SIZE * 256)
+#define LG4FF_TEST_LINE_MAX 256
+#define LG4FF_TEST_UPDATE 4000		/* Game update period in us */
+#define LG4FF_TEST_UPDATES 500
+
+static char *capture_file;
+module_param(capture_file, charp, 0);
+MODULE_PARM_DESC(capture_file, "Capture listing to replay instead of the built-in session.");
+
+struct lg4ff_replay_result {
+	unsigned int records;
+	unsigned long captured;		/* Slot commands in the capture */
+	unsigned long ticks;
+	unsigned long commands;		/* Slot commands rendered */
+	u64 time_ns;
+	unsigned long level_delta_max;
+	u64 level_delta_sum;
+};
+
+/* Run a capture through the effect mixing code, nothing is sent to any
+ * device. Ticks run at the timer period from the first record and pause
+ * while no effect is playing. The rendered constant force is compared on
+ * every tick with the last one of the capture. */
+static void lg4ff_replay(struct lg4ff_device_entry *entry, const struct lg4ff_capture_snapshot *snapshot,
+		struct lg4ff_replay_result *result)
+{
+	struct lg4ff_effect_parameters parameters[4];
+	const struct lg4ff_capture_record *record;
+	struct ff_effect effect;
+	struct lg4ff_slot *slot;
+	unsigned long now;
+	unsigned long delta;
+	unsigned int i = 0;
+	int captured_level = TRANSLATE_FORCE(0);
+	int j;
+	u64 start;
+
+	memset(result, 0, sizeof(*result));
+	result->records = snapshot->count;
+	if (!snapshot->count) {
+		return;
+	}
+
+	now = snapshot->records[0].time;
+	start = ktime_get_ns();
+
+	while (i < snapshot->count && result->ticks < LG4FF_TEST_REPLAY_TICKS) {
+		for (; i < snapshot->count && time_before_eq(snapshot->records[i].time, now); i++) {
+			record = &snapshot->records[i];
+			switch (record->kind) {
+				case LG4FF_CAPTURE_UPLOAD:
+					effect = record->data.effect;
+					if (effect.id >= 0 && effect.id < LG4FF_MAX_EFFECTS) {
+						lg4ff_publish_effect(entry, &effect, record->time);
+					}
+					break;
+				case LG4FF_CAPTURE_PLAY:
+					if (record->data.play.effect_id >= 0 && record->data.play.effect_id < LG4FF_MAX_EFFECTS) {
+						lg4ff_play_state(entry, record->data.play.effect_id, record->data.play.value, record->time);
+					}
+					break;
+				case LG4FF_CAPTURE_CMD:
+					if (record->data.cmd[0] & 0x10) {
+						captured_level = (record->data.cmd[0] & 0xf) == 3 ? TRANSLATE_FORCE(0) : record->data.cmd[2];
+					}
+					result->captured++;
+					break;
+			}
+		}
+
+		if (!entry->effects_used && !lg4ff_output_pending(entry)) {
+			if (i < snapshot->count) {
+				now = snapshot->records[i].time;
+			}
+			continue;
+		}
+
+		lg4ff_mix_effects(entry, parameters, now);
+		for (j = 0; j < 4; j++) {
+			slot = &entry->slots[j];
+			lg4ff_update_slot(slot, &parameters[j]);
+			if (slot->is_updated && lg4ff_slot_due(entry, slot, now)) {
+				lg4ff_slot_sent(slot, now);
+				result->commands++;
+			}
+		}
+
+		delta = abs(entry->slots[0].sent_cmd[2] - captured_level);
+		result->level_delta_sum += delta;
+		result->level_delta_max = max(result->level_delta_max, delta);
+		result->ticks++;
+		now += entry->rate.period;
+
+		if (!(result->ticks & 1023)) {
+			cond_resched();
+		}
+	}
+
+	result->time_ns = ktime_get_ns() - start;
+}
+
+/* Read back one line of the capture listing */
+static int lg4ff_test_parse(const char *line, struct lg4ff_capture_record *record)
+{
+	struct ff_effect *effect = &record->data.effect;
+	struct ff_envelope *envelope = NULL;
+	struct ff_condition_effect *condition;
+	char kind[8];
+	u8 *cmd = record->data.cmd;
+	int n = 0;
+	int i;
+
+	memset(record, 0, sizeof(*record));
+	if (sscanf(line, "%lu %7s%n", &record->time, kind, &n) != 2) {
+		return -EINVAL;
+	}
+	line += n;
+
+	if (!strcmp(kind, "play")) {
+		record->kind = LG4FF_CAPTURE_PLAY;
+		return sscanf(line, "%d %d", &record->data.play.effect_id, &record->data.play.value) == 2 ? 0 : -EINVAL;
+	}
+	if (!strcmp(kind, "cmd")) {
+		record->kind = LG4FF_CAPTURE_CMD;
+		return sscanf(line, "%hhx %hhx %hhx %hhx %hhx %hhx %hhx",
+				&cmd[0], &cmd[1], &cmd[2], &cmd[3], &cmd[4], &cmd[5], &cmd[6]) == 7 ? 0 : -EINVAL;
+	}
+	if (strcmp(kind, "upload")) {
+		return -EINVAL;
+	}
+
+	record->kind = LG4FF_CAPTURE_UPLOAD;
+	if (sscanf(line, "%hd %hx %hu %hu %hu%n", &effect->id, &effect->type, &effect->direction,
+				&effect->replay.delay, &effect->replay.length, &n) != 5) {
+		return -EINVAL;
+	}
+	line += n;
+
+	switch (effect->type) {
+		case FF_CONSTANT:
+			if (sscanf(line, "%hd%n", &effect->u.constant.level, &n) != 1) {
+				return -EINVAL;
+			}
+			envelope = &effect->u.constant.envelope;
+			break;
+		case FF_RAMP:
+			if (sscanf(line, "%hd %hd%n", &effect->u.ramp.start_level, &effect->u.ramp.end_level, &n) != 2) {
+				return -EINVAL;
+			}
+			envelope = &effect->u.ramp.envelope;
+			break;
+		case FF_PERIODIC:
+			if (sscanf(line, "%hx %hu %hd %hd %hu%n", &effect->u.periodic.waveform, &effect->u.periodic.period,
+					&effect->u.periodic.magnitude, &effect->u.periodic.offset, &effect->u.periodic.phase, &n) != 5) {
+				return -EINVAL;
+			}
+			envelope = &effect->u.periodic.envelope;
+			break;
+		case FF_SPRING:
+		case FF_DAMPER:
+		case FF_FRICTION:
+		case FF_INERTIA:
+			for (i = 0; i < 2; i++) {
+				condition = &effect->u.condition[i];
+				if (sscanf(line, "%hu %hu %hd %hd %hu %hd%n", &condition->right_saturation, &condition->left_saturation,
+						&condition->right_coeff, &condition->left_coeff, &condition->deadband,
+						&condition->center, &n) != 6) {
+					return -EINVAL;
+				}
+				line += n;
+			}
+			n = 0;
+			break;
+	}
+	line += n;
+
+	if (envelope && sscanf(line, "%hu %hu %hu %hu", &envelope->attack_length, &envelope->attack_level,
+				&envelope->fade_length, &envelope->fade_level) != 4) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* A saved capture listing, the comments are skipped */
+static struct lg4ff_capture_snapshot *lg4ff_test_load(struct kunit *test, const char *path)
+{
+	struct lg4ff_capture_snapshot *snapshot;
+	char line[LG4FF_TEST_LINE_MAX];
+	void *buf = NULL;
+	const char *text, *end, *eol;
+	ssize_t size;
+	size_t length;
+
+	size = kernel_read_file_from_path(path, 0, &buf, LG4FF_TEST_CAPTURE_MAX, NULL, READING_UNKNOWN);
+	if (size < 0) {
+		kunit_err(test, "Unable to read %s, errno %zd\n", path, size);
+		return NULL;
+	}
+
+	snapshot = vzalloc(sizeof(*snapshot) + LG4FF_CAPTURE_SIZE * sizeof(snapshot->records[0]));
+	if (!snapshot) {
+		vfree(buf);
+		return NULL;
+	}
+
+	for (text = buf, end = text + size; text < end && snapshot->count < LG4FF_CAPTURE_SIZE; text = eol + 1) {
+		eol = memchr(text, '\n', end - text);
+		if (!eol) {
+			eol = end;
+		}
+		length = min_t(size_t, eol - text, sizeof(line) - 1);
+		memcpy(line, text, length);
+		line[length] = '\0';
+		if (length == 0 || line[0] == '#') {
+			continue;
+		}
+		if (lg4ff_test_parse(line, &snapshot->records[snapshot->count])) {
+			kunit_err(test, "Bad capture record: %s\n", line);
+			continue;
+		}
+		snapshot->count++;
+	}
+
+	vfree(buf);
+
+	return snapshot;
+}
+
+/* A game updating a constant force along a sine every few ms over a spring.
+ * Every update comes with the slot command the device should get. */
+static struct lg4ff_capture_snapshot *lg4ff_test_session(void)
+{
+	struct lg4ff_capture_snapshot *snapshot;
+	struct lg4ff_capture_record *record;
+	unsigned long now = LG4FF_TEST_START;
+	int level;
+	int i;
+
+	snapshot = vzalloc(sizeof(*snapshot) + LG4FF_CAPTURE_SIZE * sizeof(snapshot->records[0]));
+	if (!snapshot) {
+		return NULL;
+	}
+
+	record = &snapshot->records[snapshot->count++];
+	record->time = now;
+	record->kind = LG4FF_CAPTURE_UPLOAD;
+	lg4ff_test_effect(&record->data.effect, 1, FF_SPRING, 0);
+	record->data.effect.replay.length = 0;
+
+	record = &snapshot->records[snapshot->count++];
+	record->time = now;
+	record->kind = LG4FF_CAPTURE_PLAY;
+	record->data.play.effect_id = 1;
+	record->data.play.value = 1;
+
+	for (i = 0; i < LG4FF_TEST_UPDATES; i++) {
+		level = fixp_sin16(i * 3 % 360) * 3 / 4;
+
+		record = &snapshot->records[snapshot->count++];
+		record->time = now;
+		record->kind = LG4FF_CAPTURE_UPLOAD;
+		lg4ff_test_effect(&record->data.effect, 0, FF_CONSTANT, 0);
+		memset(&record->data.effect.u.constant.envelope, 0, sizeof(struct ff_envelope));
+		record->data.effect.replay.length = 0;
+		record->data.effect.u.constant.level = level;
+
+		if (i == 0) {
+			record = &snapshot->records[snapshot->count++];
+			record->time = now;
+			record->kind = LG4FF_CAPTURE_PLAY;
+			record->data.play.effect_id = 0;
+			record->data.play.value = 1;
+		}
+
+		record = &snapshot->records[snapshot->count++];
+		record->time = now;
+		record->kind = LG4FF_CAPTURE_CMD;
+		record->data.cmd[0] = 0x1c;
+		record->data.cmd[2] = TRANSLATE_FORCE(level);
+
+		now += LG4FF_TEST_UPDATE;
+	}
+
+	return snapshot;
+}
+
+/* Replay the built-in session, or the capture given as parameter, reporting
+ * the rendering rate and how far the output strays from the capture */
+static void lg4ff_test_replay(struct kunit *test)
+{
+	struct lg4ff_device_entry *entry = test->priv;
+	struct lg4ff_capture_snapshot *snapshot;
+	struct lg4ff_replay_result result;
+
+	snapshot = capture_file ? lg4ff_test_load(test, capture_file) : lg4ff_test_session();
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, snapshot);
+
+	lg4ff_replay(entry, snapshot, &result);
+	vfree(snapshot);
+
+	KUNIT_EXPECT_GT(test, result.ticks, 0);
+	KUNIT_EXPECT_LE(test, result.commands, result.ticks * 4);
+	/* Without smoothing the game's levels go out as they come */
+	if (!capture_file && !entry->smoothing) {
+		KUNIT_EXPECT_LE(test, result.level_delta_max, 1);
+	}
+
+	kunit_info(test, "records %u captured %lu ticks %lu commands %lu ticks_per_sec %llu level_delta_mean %llu level_delta_max %lu\n",
+			result.records, result.captured, result.ticks, result.commands,
+			result.time_ns ? div64_u64((u64)result.ticks * NSEC_PER_SEC, result.time_ns) : 0,
+			result.ticks ? div64_u64(result.level_delta_sum, result.ticks) : 0,
+			result.level_delta_max);
+}
+#endif
+
+/* State of a G27 with the default settings and no device behind it. The
+ * driver options of this module apply to it. */
+static int lg4ff_test_init(struct kunit *test)
+{
+	struct lg4ff_device_entry *entry;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(lg4ff_devices); i++) {
+		if (lg4ff_devices[i].product_id == USB_DEVICE_ID_LOGITECH_G27_WHEEL) {
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(lg4ff_devices)) {
+		return -ENODEV;
+	}
+
+	entry = vzalloc(sizeof(*entry));
+	if (!entry) {
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&entry->timer_lock);
+	lg4ff_init_wheel_data(&entry->wdata, &lg4ff_devices[i], NULL, USB_DEVICE_ID_LOGITECH_G27_WHEEL);
+	entry->wdata.master_gain = 0xffff;
+	entry->wdata.gain = 0xffff;
+	entry->timer_mode = timer_mode;
+	entry->smoothing = smoothing ? 1 : 0;
+	entry->dithering = dithering ? 1 : 0;
+	entry->hysteresis_time = DEFAULT_HYSTERESIS_TIME;
+	entry->spring_level = clamp(spring_level, 0, 100);
+	entry->damper_level = clamp(damper_level, 0, 100);
+	entry->friction_level = clamp(friction_level, 0, 100);
+	entry->inertia_level = clamp(inertia_level, 0, 100);
+	lg4ff_build_scale(entry);
+	lg4ff_init_rate(entry);
+	seqcount_init(&entry->motion.seq);
+	lg4ff_reset_slots(entry);
+
+	test->priv = entry;
+
+	return 0;
+}
+
+static void lg4ff_test_exit(struct kunit *test)
+{
+	vfree(test->priv);
+}
+
+static int lg4ff_test_suite_init(struct kunit_suite *suite)
+{
+	lg4ff_init_wave_tables();
+
+	return 0;
+}
+
+static struct kunit_case lg4ff_test_cases[] = {
+	KUNIT_CASE_PARAM(lg4ff_test_curve, lg4ff_test_curves_gen_params),
+	KUNIT_CASE_PARAM(lg4ff_test_slot, lg4ff_test_slots_gen_params),
+	KUNIT_CASE(lg4ff_test_slot_reset),
+	KUNIT_CASE(lg4ff_test_tick),
+#ifdef CONFIG_DEBUG_FS
+	KUNIT_CASE(lg4ff_test_replay),
+#endif
+	{}
+};
+
+static struct kunit_suite lg4ff_test_suite = {
+	.name = "hid-lg4ff",
+	.suite_init = lg4ff_test_suite_init,
+	.init = lg4ff_test_init,
+	.exit = lg4ff_test_exit,
+	.test_cases = lg4ff_test_cases,
+};
+
+kunit_test_suite(lg4ff_test_suite);
+
+MODULE_DESCRIPTION("KUnit tests for the Logitech wheels force feedback");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lg4ff
+
+#if !defined(__HID_LG4FF_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __HID_LG4FF_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/hid.h>
+
+TRACE_EVENT(lg4ff_upload,
+	TP_PROTO(struct hid_device *hid, int effect_id, int type),
+	TP_ARGS(hid, effect_id, type),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(int, effect_id)
+		__field(int, type)
+	),
+	TP_fast_assign(
+		__entry->dev = hid->id;
+		__entry->effect_id = effect_id;
+		__entry->type = type;
+	),
+	TP_printk("dev=%u effect=%d type=%#x", __entry->dev, __entry->effect_id, __entry->type)
+);
+
+TRACE_EVENT(lg4ff_play,
+	TP_PROTO(struct hid_device *hid, int effect_id, int value),
+	TP_ARGS(hid, effect_id, value),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(int, effect_id)
+		__field(int, value)
+	),
+	TP_fast_assign(
+		__entry->dev = hid->id;
+		__entry->effect_id = effect_id;
+		__entry->value = value;
+	),
+	TP_printk("dev=%u effect=%d value=%d", __entry->dev, __entry->effect_id, __entry->value)
+);
+
+TRACE_EVENT(lg4ff_tick,
+	TP_PROTO(struct hid_device *hid, long lateness, unsigned int depth, int sent),
+	TP_ARGS(hid, lateness, depth, sent),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(long, lateness)
+		__field(unsigned int, depth)
+		__field(int, sent)
+	),
+	TP_fast_assign(
+		__entry->dev = hid->id;
+		__entry->lateness = lateness;
+		__entry->depth = depth;
+		__entry->sent = sent;
+	),
+	TP_printk("dev=%u lateness=%ldus depth=%u sent=%d", __entry->dev, __entry->lateness, __entry->depth, __entry->sent)
+);
+
+TRACE_EVENT(lg4ff_send,
+	TP_PROTO(struct hid_device *hid, const u8 *cmd),
+	TP_ARGS(hid, cmd),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__array(u8, cmd, 7)
+	),
+	TP_fast_assign(
+		__entry->dev = hid->id;
+		memcpy(__entry->cmd, cmd, 7);
+	),
+	TP_printk("dev=%u cmd=%*phD", __entry->dev, 7, __entry->cmd)
+);
+
+TRACE_EVENT(lg4ff_drain,
+	TP_PROTO(struct hid_device *hid, unsigned long drain_time),
+	TP_ARGS(hid, drain_time),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(unsigned long, drain_time)
+	),
+	TP_fast_assign(
+		__entry->dev = hid->id;
+		__entry->drain_time = drain_time;
+	),
+	TP_printk("dev=%u drain_time=%luus", __entry->dev, __entry->drain_time)
+);
+
+#endif /* __HID_LG4FF_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hid-lg4ff-trace
+#include <trace/define_trace.h>
@@ -15,13 +15,26 @@
 #include <linux/hid.h>
 #include <linux/fixp-arith.h>
 #include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
 #include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/seqlock.h>
+#include <linux/bitmap.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
 
 #include "usbhid/usbhid.h"
 #include "hid-lg.h"
 #include "hid-lg4ff.h"
 #include "hid-ids.h"
 
+#define CREATE_TRACE_POINTS
+#include "hid-lg4ff-trace.h"
+
 #define LG4FF_VERSION "0.4.2"
 
 #define LG4FF_MMODE_IS_MULTIMODE 0
@@ -83,35 +96,108 @@
 #define SCALE_COEFF(x, bits) SCALE_VALUE_U16(abs(x) * 2, bits)
 #define TRANSLATE_FORCE(x) ((CLAMP_VALUE_S16(x) + 0x8000) >> 8)
 #define STOP_EFFECT(state) ((state)->flags = 0)
-#define JIFFIES2MS(jiffies) ((jiffies) * 1000 / HZ)
+#define MS2US(ms) ((unsigned long)(ms) * USEC_PER_MSEC)
 #undef fixp_sin16
 #define fixp_sin16(v) (((v % 360) > 180)? -(fixp_sin32((v % 360) - 180) >> 16) : fixp_sin32(v) >> 16)
 
 #define DEFAULT_TIMER_PERIOD 2
-#define LG4FF_MAX_EFFECTS 16
+#define LG4FF_MIN_TIMER_PERIOD_US 100
+#define LG4FF_MAX_TIMER_PERIOD 16
+#define LG4FF_RATE_RECOVERY_TICKS 32
+#define LG4FF_LEDS_METER_PERIOD 480
+#define LG4FF_MAX_EFFECTS 64
+#define DEFAULT_MAX_EFFECTS 32
+#define LG4FF_FIXED_LOOP_MS 2
+#define LG4FF_SAVED_CONFIGS 8
+#define LG4FF_SCHED_PHASES 8
+#define LG4FF_BUS_GROUPS 8
+#define LG4FF_BUS_WINDOW 2
+#define LG4FF_TELEMETRY_VERSION 1
+#define LG4FF_TELEMETRY_RECORDS 1024
+#define LG4FF_TELEMETRY_OFFSET 64
+#define LG4FF_NATIVE_SQUARE 0x07
+#define LG4FF_CURVE_POINTS 256
+#define LG4FF_CURVE_SHIFT 32
+#define LG4FF_SCALE_SHIFT 16
+#define LG4FF_WAVE_BITS 8
+#define LG4FF_WAVE_SIZE (1 << LG4FF_WAVE_BITS)
+#define LG4FF_WAVE_LEVELS 4
+#define LG4FF_WAVE_SQUARE 0
+#define LG4FF_WAVE_TRIANGLE 1
+#define LG4FF_WAVE_SAW 2
+#define LG4FF_HIST_BUCKETS 20
+#define LG4FF_MOTION_TIMEOUT 50000
+#define LG4FF_INERTIA_SHIFT 6
+#define LG4FF_SMOOTH_MAX_INTERVAL 100000
+#define DEFAULT_HYSTERESIS_TIME 10000
+#define LG4FF_CTRL_LEDS 0
+#define LG4FF_CTRL_RANGE 1
+#define LG4FF_CTRL_AUTOCENTER 2
+#define LG4FF_CTRL_COUNT 3
+#define LG4FF_CTRL_MAX_CMDS 2
+#define LG4FF_CTRL_DELAY 20
+#define LG4FF_OUTPUT_CONTROL 4
+#define LG4FF_OUTPUTS 5
+#define LG4FF_OUTPUT_SIZE 7
+#define LG4FF_CAPTURE_SIZE 4096
+#define LG4FF_CAPTURE_UPLOAD 0
+#define LG4FF_CAPTURE_PLAY 1
+#define LG4FF_CAPTURE_CMD 2
 
 #define FF_EFFECT_STARTED 0
 #define FF_EFFECT_ALLSET 1
 #define FF_EFFECT_PLAYING 2
 #define FF_EFFECT_UPDATING 3
 
-struct lg4ff_effect_state {
+/* Effect invariants computed on upload so that the timer only has to
+ * multiply and shift. Times are microseconds, slopes are Q32 per microsecond,
+ * the phase rate is Q48 turns per microsecond and phases are Q32 turns */
+struct lg4ff_effect_coeffs {
+	unsigned long delay;
+	unsigned long length;
+	unsigned long attack_length;
+	long fade_start;
+	int level;
+	int attack_level;
+	int fade_level;
+	int direction_gain;	/* Q16 */
+	s64 attack_slope;
+	s64 fade_slope;
+	s64 slope;
+	u64 phase_rate;
+	u32 phase_adj;
+	const s16 *wave;	/* NULL for the exact square, triangle and saw */
+	unsigned int native_loops;	/* Half period of a square wave the device can play, 0 if none */
+};
+
+/* Effect parameters, only looked at by the timer while the effect plays */
+struct lg4ff_effect_data {
 	struct ff_effect effect;
-	struct ff_envelope *envelope;
+	struct ff_effect pending;	/* Last upload, published through seq */
+	struct lg4ff_effect_coeffs pending_coeffs;
+	unsigned long pending_at;
+	unsigned long fetched_at;
+	seqcount_t seq;
+	unsigned int fetched_seq;
+};
+
+/* Playback state used every tick. All times are microseconds on the
+ * lg4ff_now() clock */
+struct lg4ff_effect_state {
+	struct ff_effect *effect;
+	struct lg4ff_effect_coeffs coeffs;
 	unsigned long start_at;
 	unsigned long play_at;
 	unsigned long stop_at;
 	unsigned long flags;
 	unsigned long time_playing;
 	unsigned long updated_at;
-	unsigned int phase;
-	unsigned int phase_adj;
+	u32 phase;
+	u32 phase_adj;
 	unsigned int count;
 	unsigned int cmd;
 	unsigned int cmd_start_time;
 	unsigned int cmd_start_count;
-	int direction_gain;
-	int slope;
 	unsigned int slot;
 };
 
@@ -122,16 +208,125 @@ struct lg4ff_effect_parameters {
 	int k1;
 	int k2;
 	unsigned int clip;
+	int low_level;		/* Native square wave second level */
+	unsigned int loops;	/* Native square wave half period in device loops */
+	unsigned int users;	/* Condition effects merged in the slot */
+	unsigned int weight;
+	s64 d1_sum;		/* Spring bounds weighted by the coefficients */
+	s64 d2_sum;
+};
+
+/* Kinds of slot scaling, the condition kinds also take their level */
+enum lg4ff_scale_kind {
+	LG4FF_SCALE_FORCE,
+	LG4FF_SCALE_SPRING,
+	LG4FF_SCALE_DAMPER,
+	LG4FF_SCALE_FRICTION,
+	LG4FF_SCALE_KINDS
+};
+
+/* Gains and levels folded into factors shifted by LG4FF_SCALE_SHIFT, rebuilt
+ * whenever one of them changes */
+struct lg4ff_scale {
+	u32 gain;			/* Application gain times the master gain */
+	u32 clip[LG4FF_SCALE_KINDS];	/* Gain times the level of the kind */
+	u32 meter[LG4FF_SCALE_KINDS];	/* Share of the unscaled clip in the FFB level */
+	u32 inertia;			/* Inertia level, the gain comes later with the force */
 };
 
 struct lg4ff_slot {
 	int id;
-	struct lg4ff_effect_parameters parameters;
+	struct lg4ff_effect_parameters parameters;	/* Values behind current_cmd */
+	struct lg4ff_effect_parameters sent_parameters;	/* Values behind sent_cmd */
 	u8 current_cmd[7];
 	int cmd_op;
-	int is_updated;
+	int is_updated;		/* current_cmd is pending to be sent */
 	int effect_type;
+	unsigned int users;	/* Started effects sharing the slot */
+	u8 sent_cmd[7];		/* Last command sent */
+	unsigned long sent_at;
+	unsigned int threshold;	/* Smallest parameter change sent right away */
+};
+
+/* Wheel motion estimated from the input reports. Positions are normalized to
+ * the s16 range. The input path only low pass filters the change per report
+ * and the report interval, the velocity and acceleration are derived from
+ * them when needed. */
+struct lg4ff_motion_sample {
+	int position;
+	int delta;		/* Position change per report, Q8 */
+	int delta2;		/* Change of delta per report, Q8 */
+	unsigned int interval;	/* Time between reports in us */
+	unsigned long updated_at;
+};
+
+/* Written by the input path only, published through seq */
+struct lg4ff_motion {
+	seqcount_t seq;
+	struct lg4ff_motion_sample sample;
+	int span;
+	u32 scale;		/* Q16 from logical units to the s16 range */
+};
+
+/* Constant force interpolation between uploads and dithering of the 8 bit
+ * output. Levels and steps are Q8, times in microseconds. */
+struct lg4ff_smoothing {
+	unsigned long upload_at;	/* Last constant force upload */
+	unsigned int interval;		/* Average time between uploads */
+	int target;
+	int level;
+	int step;
+	int residual;
+};
+
+/* Low priority commands for a device setting, a new request replaces the
+ * pending one */
+struct lg4ff_control {
+	u8 cmd[LG4FF_CTRL_MAX_CMDS][7];
+	int count;
+	int is_updated;
+};
+
+/* Timer period controller, periods and times in microseconds */
+struct lg4ff_rate_control {
+	unsigned int period;
+	unsigned int min_period;
+	unsigned int max_period;
+	unsigned int idle_ticks;
+	unsigned int drain_time;	/* Average time for the queued commands to complete */
+	int drain_exact;	/* The last drain was timed by the URB completion */
+	unsigned int depth;
+	unsigned int max_depth;
+	unsigned long sent_at;
+	int busy;
+	int draining;
+	unsigned long ticks;
+	unsigned long busy_ticks;
+	unsigned long overruns;
+	unsigned long backoffs;
+	unsigned long recoveries;
+};
+
+/* Output reports submitted straight to the interrupt out endpoint, one per
+ * slot and one for the settings. Each carries one command at a time. */
+struct lg4ff_output {
+	struct urb *urbs[LG4FF_OUTPUTS];
+	u8 *bufs[LG4FF_OUTPUTS];
+	unsigned long busy;		/* Outputs in flight */
+	atomic_t inflight;
+	unsigned long completed_at;	/* Last completion in us */
+	int enabled;
+};
+
+#ifdef CONFIG_LEDS_CLASS
+struct lg4ff_leds_meter {
+	int level;			/* Peak level since the last refresh */
+	unsigned long refresh_at;	/* Microseconds */
+	u8 state;			/* Leds shown */
+	int is_updated;			/* state is pending to be sent */
+	unsigned long due_at;		/* Sent by then even behind slot commands */
 };
+#endif
 
 struct lg4ff_wheel_data {
 	const u32 product_id;
@@ -155,20 +350,197 @@ struct lg4ff_wheel_data {
 	void (*set_range)(struct hid_device *hid, u16 range);
 };
 
+/* Log2 histogram, bucket n counts the values in [2^(n-1), 2^n) */
+struct lg4ff_histogram {
+	unsigned long buckets[LG4FF_HIST_BUCKETS];
+	unsigned long count;
+	unsigned long max;
+	u64 sum;
+};
+
+/* Output loop statistics, only updated by the timer */
+struct lg4ff_stats {
+	struct lg4ff_histogram jitter;		/* Tick lateness in us */
+	struct lg4ff_histogram latency;		/* Upload to drained queue in us */
+	struct lg4ff_histogram compute;		/* Tick run time in ns */
+	struct lg4ff_histogram skip_depth;	/* Queued reports on held ticks */
+	unsigned long upload_at;	/* Oldest upload not sent yet */
+	unsigned long queued_at;	/* Oldest upload in the output queue */
+	unsigned long sent;
+	unsigned long suppressed;
+	unsigned long held;
+	unsigned long immediate;
+	unsigned long deferred;
+	unsigned long direct;
+	unsigned long throttled;
+};
+
+/* Wheel axis curve sampled at evenly spaced positions of the logical range,
+ * positions in between are interpolated */
+struct lg4ff_curve {
+	s32 min;
+	s32 max;
+	u64 scale;	/* Points per logical unit shifted by LG4FF_CURVE_SHIFT */
+	s32 points[LG4FF_CURVE_POINTS + 1];
+};
+
+/* Settings made through sysfs, kept after the device goes away so they can
+ * be brought back when the same wheel is connected again */
+struct lg4ff_config {
+	u16 range;
+	u16 combine;
+	u16 master_gain;
+	u16 autocenter;
+	unsigned spring_level;
+	unsigned damper_level;
+	unsigned friction_level;
+	unsigned inertia_level;
+	unsigned deadzone;
+	unsigned linearity;
+	unsigned int min_period;
+	unsigned int hysteresis_time;
+	unsigned int thresholds[4];
+	int timer_mode;
+	int fast_constant;
+	int hw_periodic;
+	int smoothing;
+	int dithering;
+	int ffb_leds;
+};
+
+/* Command budget shared by the wheels behind the same hub. One command takes
+ * USEC_PER_MSEC tokens, the budget puts back that many every ms for each
+ * command. */
+struct lg4ff_bus_group {
+	struct usb_device *hub;
+	spinlock_t lock;	/* Protect the tokens */
+	unsigned long refill_at;
+	unsigned long tokens;
+	unsigned int budget;	/* Commands per ms */
+	int users;
+};
+
+struct lg4ff_saved_config {
+	char key[64];		/* Serial number or physical path */
+	u16 real_product_id;
+	unsigned long serial;	/* Save order, the oldest gets replaced */
+	struct lg4ff_config config;
+};
+
+#ifdef CONFIG_DEBUG_FS
+struct lg4ff_capture_record {
+	unsigned long time;	/* Microseconds */
+	int kind;
+	union {
+		struct ff_effect effect;
+		struct {
+			int effect_id;
+			int value;
+		} play;
+		u8 cmd[7];
+	} data;
+};
+
+struct lg4ff_telemetry_slot {
+	s32 level;
+	s32 k1;
+	s32 k2;
+	u32 clip;
+};
+
+/* One record per timer tick. seq is odd while the record is written. */
+struct lg4ff_telemetry_record {
+	u32 seq;
+	u32 index;		/* Position in the ring since the start */
+	u64 time;		/* Microseconds */
+	s32 level;		/* Mixed force before clipping */
+	u32 clipped;
+	u32 ffb_level;		/* Total level, as shown by the leds meter */
+	u32 peak_ffb_level;
+	s32 position;		/* Wheel position in the s16 range */
+	s32 velocity;		/* Position units per second */
+	struct lg4ff_telemetry_slot slots[4];
+};
+
+/* Telemetry mapped read only by userspace, followed by the records. The
+ * timer is the only writer, readers copy the records behind head and drop
+ * the ones with an odd or changed seq or a different index. */
+struct lg4ff_telemetry {
+	u32 version;
+	u32 records;
+	u32 record_size;
+	u32 offset;		/* Of the first record */
+	u32 head;		/* Records written since the start */
+};
+
+/* Ring of the latest uploads, plays and slot commands, the oldest records
+ * get overwritten */
+struct lg4ff_capture {
+	spinlock_t lock;
+	struct mutex mutex;	/* Serialize the snapshots with the restarts */
+	struct lg4ff_capture_record *records;
+	unsigned long head;	/* Records written since the start */
+	int active;
+};
+#endif
+
 struct lg4ff_device_entry {
 	spinlock_t report_lock; /* Protect output HID report */
-	spinlock_t timer_lock;
+	spinlock_t timer_lock;	/* Protect effect playback state */
+	spinlock_t control_lock;	/* Protect the control mailboxes */
 	struct hid_report *report;
+	struct lg4ff_output output;
 	struct lg4ff_wheel_data wdata;
+	const struct lg4ff_pedals_fixup *pedals;	/* Resolved from combine */
+	struct mutex curve_mutex;	/* Serialize curve updates */
+	struct lg4ff_curve curves[2];
+	const struct lg4ff_curve *curve;	/* NULL when the axis is reported as is */
+	unsigned deadzone;
+	unsigned linearity;
 	struct hid_device *hid;
 	struct timer_list timer;
 	struct hrtimer hrtimer;
+	enum hrtimer_mode hrtimer_mode;
+	struct task_struct *thread;	/* Runs the ticks when timer_context is 2 */
+	int thread_ticking;	/* The thread owns the timer, protected by timer_lock */
+	int thread_due;
+	int phase;	/* Offset in the shared tick grid in 1/8 periods, -1 when not staggered */
+	struct lg4ff_bus_group *bus_group;
 	struct lg4ff_slot slots[4];
 	struct lg4ff_effect_state states[LG4FF_MAX_EFFECTS];
+	struct lg4ff_effect_data effects[LG4FF_MAX_EFFECTS];
+	DECLARE_BITMAP(active_effects, LG4FF_MAX_EFFECTS);
+	struct lg4ff_rate_control rate;
+	int timer_mode;
+	int fast_constant;
+	int hw_periodic;
+	unsigned long fast_sent_at;
+	struct lg4ff_motion motion;
+	struct lg4ff_motion_sample motion_sample;	/* Last read by the timer */
+	int smoothing;
+	int dithering;
+	struct lg4ff_smoothing smooth;
+	unsigned int hysteresis_time;	/* Deadline for deferred slot changes in us */
+	struct lg4ff_control controls[LG4FF_CTRL_COUNT];
+	struct delayed_work control_work;
+	struct work_struct init_work;	/* Setup left out of the probe */
+	unsigned spring_level;
+	unsigned damper_level;
+	unsigned friction_level;
+	unsigned inertia_level;
+	struct lg4ff_scale scale;
 	unsigned peak_ffb_level;
 	int effects_used;
+	struct lg4ff_stats stats;
+#ifdef CONFIG_DEBUG_FS
+	struct dentry *debug_dir;
+	struct lg4ff_capture capture;
+	struct lg4ff_telemetry *telemetry;
+#endif
 #ifdef CONFIG_LEDS_CLASS
 	int has_leds;
+	int ffb_leds;
+	struct lg4ff_leds_meter leds_meter;
 #endif
 };
 
@@ -227,10 +599,24 @@ struct lg4ff_alternate_mode {
 	const char *name;
 };
 
+/* Raw input report fixup for combined pedals. With copy the combined axis
+ * is already in the report at src and gets moved to dst, otherwise the
+ * pedals at dst and src are combined into dst. The idle byte is then
+ * centered, it's always the last one touched. */
+struct lg4ff_pedals_fixup {
+	const u16 product_id;
+	const u16 combine;
+	const u8 dst;
+	const u8 src;
+	const u8 idle;
+	const u8 copy;
+};
+
 static void lg4ff_set_range_dfp(struct hid_device *hid, u16 range);
 static void lg4ff_set_range_g25(struct hid_device *hid, u16 range);
 #ifdef CONFIG_LEDS_CLASS
 static void lg4ff_set_leds(struct hid_device *hid, u8 leds);
+static void lg4ff_queue_leds(struct lg4ff_device_entry *entry, u8 leds);
 #endif
 
 static const struct lg4ff_wheel lg4ff_devices[] = {
@@ -296,6 +682,25 @@ static const struct lg4ff_alternate_mode lg4ff_alternate_modes[] = {
 	[LG4FF_MODE_G923_IDX] = {USB_DEVICE_ID_LOGITECH_G923_WHEEL, LG4FF_G923_TAG, LG4FF_G923_NAME},
 };
 
+static const struct lg4ff_pedals_fixup lg4ff_pedals_fixups[] = {
+	{USB_DEVICE_ID_LOGITECH_WHEEL,		1, 5, 3, 6, 1},
+	{USB_DEVICE_ID_LOGITECH_WINGMAN_FG,	1, 4, 3, 5, 1},
+	{USB_DEVICE_ID_LOGITECH_WINGMAN_FFG,	1, 4, 3, 5, 1},
+	{USB_DEVICE_ID_LOGITECH_MOMO_WHEEL,	1, 4, 3, 5, 1},
+	{USB_DEVICE_ID_LOGITECH_MOMO_WHEEL2,	1, 4, 3, 5, 1},
+	{USB_DEVICE_ID_LOGITECH_DFP_WHEEL,	1, 5, 4, 6, 1},
+	{USB_DEVICE_ID_LOGITECH_G25_WHEEL,	1, 5, 6, 6, 0},
+	{USB_DEVICE_ID_LOGITECH_G27_WHEEL,	1, 5, 6, 6, 0},
+	{USB_DEVICE_ID_LOGITECH_DFGT_WHEEL,	1, 6, 7, 7, 0},
+	{USB_DEVICE_ID_LOGITECH_G29_WHEEL,	1, 6, 7, 7, 0},
+	{USB_DEVICE_ID_LOGITECH_G923_WHEEL,	1, 6, 7, 7, 0},
+	{USB_DEVICE_ID_LOGITECH_WII_WHEEL,	1, 3, 4, 4, 0},
+	{USB_DEVICE_ID_LOGITECH_G25_WHEEL,	2, 5, 7, 7, 0},
+	{USB_DEVICE_ID_LOGITECH_G27_WHEEL,	2, 5, 7, 7, 0},
+	{USB_DEVICE_ID_LOGITECH_G29_WHEEL,	2, 6, 8, 8, 0},
+	{USB_DEVICE_ID_LOGITECH_G923_WHEEL,	2, 6, 8, 8, 0},
+};
+
 /* Multimode wheel identificators */
 static const struct lg4ff_wheel_ident_info lg4ff_dfp_ident_info = {
 	LG4FF_MODE_DFP | LG4FF_MODE_DFEX,
@@ -423,15 +828,55 @@ static const struct lg4ff_compat_mode_switch lg4ff_mode_switch_30_g923 = {
 
 static int timer_msecs = DEFAULT_TIMER_PERIOD;
 module_param(timer_msecs, int, 0660);
-MODULE_PARM_DESC(timer_msecs, "Timer resolution in msecs.");
+MODULE_PARM_DESC(timer_msecs, "Default timer resolution in msecs.");
 
 static int fixed_loop = 0;
 module_param(fixed_loop, int, 0);
 MODULE_PARM_DESC(fixed_loop, "Put the device into fixed loop mode.");
 
-static int timer_mode = 2;
+static int timer_mode = 3;
 module_param(timer_mode, int, 0660);
-MODULE_PARM_DESC(timer_mode, "Timer mode: 0) fixed, 1) static, 2) dynamic (default).");
+MODULE_PARM_DESC(timer_mode, "Default timer mode: 0) fixed, 1) static, 2) dynamic, 3) adaptive (default).");
+
+static int timer_context = 0;
+module_param(timer_context, int, 0);
+MODULE_PARM_DESC(timer_context, "Where the timer runs: 0) hard irq (default), 1) soft irq, 2) realtime thread.");
+
+static int timer_cpu = -1;
+module_param(timer_cpu, int, 0);
+MODULE_PARM_DESC(timer_cpu, "CPU to pin the realtime thread to, -1 for any (default).");
+
+static int stagger = 0;
+module_param(stagger, int, 0);
+MODULE_PARM_DESC(stagger, "Spread the timer ticks of the wheels over the timer period (0-1).");
+
+static int bus_budget = 0;
+module_param(bus_budget, int, 0);
+MODULE_PARM_DESC(bus_budget, "Commands per ms shared by the wheels behind the same hub, 0 for no limit (default).");
+
+static int fast_constant = 0;
+module_param(fast_constant, int, 0660);
+MODULE_PARM_DESC(fast_constant, "Default for sending constant force updates right away (0-1).");
+
+static int hw_periodic = 0;
+module_param(hw_periodic, int, 0660);
+MODULE_PARM_DESC(hw_periodic, "Default for letting the device play square waves by itself, needs fixed_loop (0-1).");
+
+static int smoothing = 0;
+module_param(smoothing, int, 0660);
+MODULE_PARM_DESC(smoothing, "Default for interpolating constant forces between updates (0-1).");
+
+static int dithering = 0;
+module_param(dithering, int, 0660);
+MODULE_PARM_DESC(dithering, "Default for dithering the constant force output (0-1).");
+
+static int direct_output = 1;
+module_param(direct_output, int, 0);
+MODULE_PARM_DESC(direct_output, "Send force commands through preallocated output reports (0-1).");
+
+static int max_effects = DEFAULT_MAX_EFFECTS;
+module_param(max_effects, int, 0);
+MODULE_PARM_DESC(max_effects, "Maximum number of effects per device (1-64).");
 
 static int profile = 0;
 module_param(profile, int, 0660);
@@ -445,15 +890,68 @@ MODULE_PARM_DESC(ffb_leds, "Use leds to display FFB levels for calibration.");
 
 static int spring_level = 30;
 module_param(spring_level, int, 0);
-MODULE_PARM_DESC(spring_level, "Level of spring force (0-100).");
+MODULE_PARM_DESC(spring_level, "Default level of spring force (0-100).");
 
 static int damper_level = 30;
 module_param(damper_level, int, 0);
-MODULE_PARM_DESC(damper_level, "Level of damper force (0-100).");
+MODULE_PARM_DESC(damper_level, "Default level of damper force (0-100).");
 
 static int friction_level = 30;
 module_param(friction_level, int, 0);
-MODULE_PARM_DESC(friction_level, "Level of friction force (0-100).");
+MODULE_PARM_DESC(friction_level, "Default level of friction force (0-100).");
+
+static int inertia_level = 30;
+module_param(inertia_level, int, 0);
+MODULE_PARM_DESC(inertia_level, "Default level of inertia force (0-100).");
+
+/* Waveform tables shared by all devices, one extra entry to interpolate past
+ * the end. The band-limited variants keep 1, 3, 7 and 15 harmonics */
+static s16 lg4ff_sine_table[LG4FF_WAVE_SIZE + 1];
+static s16 lg4ff_wave_tables[3][LG4FF_WAVE_LEVELS][LG4FF_WAVE_SIZE + 1];
+static bool lg4ff_wave_tables_ready;
+static DEFINE_MUTEX(lg4ff_wave_mutex);
+
+static struct lg4ff_saved_config lg4ff_saved_configs[LG4FF_SAVED_CONFIGS];
+static unsigned long lg4ff_saved_serial;
+static DEFINE_MUTEX(lg4ff_saved_mutex);
+
+/* Phases are handed out so that the ticks stay evenly spread for any
+ * number of wheels */
+static const u8 lg4ff_sched_order[LG4FF_SCHED_PHASES] = {0, 4, 2, 6, 1, 5, 3, 7};
+static unsigned long lg4ff_sched_phases;
+static ktime_t lg4ff_sched_epoch;
+static struct lg4ff_bus_group lg4ff_bus_groups[LG4FF_BUS_GROUPS];
+static DEFINE_MUTEX(lg4ff_sched_mutex);
+
+static __always_inline unsigned long lg4ff_now(void)
+{
+	return (unsigned long)ktime_to_us(ktime_get());
+}
+
+/* Position units per second */
+static __always_inline int lg4ff_motion_velocity(const struct lg4ff_motion_sample *sample)
+{
+	if (!sample->interval) {
+		return 0;
+	}
+
+	return clamp_val(div_s64((s64)sample->delta * USEC_PER_SEC, sample->interval) >> 8, -INT_MAX, INT_MAX);
+}
+
+/* Position units per second squared */
+static __always_inline int lg4ff_motion_acceleration(const struct lg4ff_motion_sample *sample)
+{
+	s64 acceleration;
+
+	if (!sample->interval) {
+		return 0;
+	}
+
+	acceleration = div_s64((s64)sample->delta2 * USEC_PER_SEC, sample->interval);
+	acceleration = div_s64(acceleration * USEC_PER_SEC, sample->interval) >> 8;
+
+	return clamp_val(acceleration, -INT_MAX, INT_MAX);
+}
 
 static struct lg4ff_device_entry *lg4ff_get_device_entry(struct hid_device *hid)
 {
@@ -496,12 +994,11 @@ static void lg4ff_send_cmd_with_id(struct lg4ff_device_entry *entry, u8 *cmd, u8
 	DEBUG("send_cmd: %02X %02X %02X %02X %02X %02X %02X %02X\n", id, cmd[0], cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6]);
 }
 
-static void lg4ff_send_cmd(struct lg4ff_device_entry *entry, u8 *cmd)
+/* Must be called with report_lock held */
+static void lg4ff_queue_cmd(struct lg4ff_device_entry *entry, u8 *cmd)
 {
-	unsigned long flags;
 	s32 *value = entry->report->field[0]->value;
 
-	spin_lock_irqsave(&entry->report_lock, flags);
 	value[0] = cmd[0];
 	value[1] = cmd[1];
 	value[2] = cmd[2];
@@ -510,1220 +1007,3371 @@ static void lg4ff_send_cmd(struct lg4ff_device_entry *entry, u8 *cmd)
 	value[5] = cmd[5];
 	value[6] = cmd[6];
 	hid_hw_request(entry->hid, entry->report, HID_REQ_SET_REPORT);
+	trace_lg4ff_send(entry->hid, cmd);
+}
+
+static void lg4ff_send_cmd(struct lg4ff_device_entry *entry, u8 *cmd)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&entry->report_lock, flags);
+	lg4ff_queue_cmd(entry, cmd);
 	spin_unlock_irqrestore(&entry->report_lock, flags);
-	DEBUG("send_cmd: %02X %02X %02X %02X %02X %02X %02X", cmd[0], cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6]);
 }
 
-static void lg4ff_update_slot(struct lg4ff_slot *slot, struct lg4ff_effect_parameters *parameters)
+static __always_inline unsigned int lg4ff_queue_depth(struct usbhid_device *usbhid)
 {
-	u8 original_cmd[7];
-	int d1;
-	int d2;
-	int k1;
-	int k2;
-	int s1;
-	int s2;
+	return (usbhid->outhead - usbhid->outtail) & (HID_OUTPUT_FIFO_SIZE - 1);
+}
 
-	memcpy(original_cmd, slot->current_cmd, sizeof(original_cmd));
+/* Commands waiting in the usbhid queue plus our own reports in flight */
+static __always_inline unsigned int lg4ff_output_depth(struct lg4ff_device_entry *entry)
+{
+	return lg4ff_queue_depth(entry->hid->driver_data) + atomic_read(&entry->output.inflight);
+}
 
-	if ((original_cmd[0] & 0xf) == 1) {
-		original_cmd[0] = (original_cmd[0] & 0xf0) + 0xc;
-	}
+static __always_inline int lg4ff_output_busy(struct lg4ff_device_entry *entry, int index)
+{
+	return entry->output.enabled && test_bit(index, &entry->output.busy);
+}
 
-	if (slot->effect_type == FF_CONSTANT) {
-		if (slot->cmd_op == 0) {
-			slot->cmd_op = 1;
-		} else {
-			slot->cmd_op = 0xc;
-		}
-	} else {
-		if (parameters->clip == 0 || slot->effect_type == 0) {
-			slot->cmd_op = 3;
-		} else if (slot->cmd_op == 3) {
-			slot->cmd_op = 1;
-		} else {
-			slot->cmd_op = 0xc;
+static void lg4ff_output_complete(struct urb *urb)
+{
+	struct lg4ff_device_entry *entry = urb->context;
+	struct lg4ff_output *output = &entry->output;
+	int i;
+
+	for (i = 0; i < LG4FF_OUTPUTS; i++) {
+		if (output->urbs[i] == urb) {
+			break;
 		}
 	}
 
-	slot->current_cmd[0] = (0x10 << slot->id) + slot->cmd_op;
+	switch (urb->status) {
+		case 0:
+			WRITE_ONCE(output->completed_at, lg4ff_now());
+			break;
+		case -ENOENT:
+		case -ECONNRESET:
+			break;
+		case -ESHUTDOWN:
+		case -ENODEV:
+		case -EPROTO:
+			output->enabled = 0;
+			break;
+		default:
+			hid_warn(entry->hid, "Output report failed, errno %d\n", urb->status);
+	}
 
-	if (slot->cmd_op == 3) {
-		slot->current_cmd[1] = 0;
-		slot->current_cmd[2] = 0;
-		slot->current_cmd[3] = 0;
-		slot->current_cmd[4] = 0;
-		slot->current_cmd[5] = 0;
-		slot->current_cmd[6] = 0;
-	} else {
-		switch (slot->effect_type) {
-			case FF_CONSTANT:
-				slot->current_cmd[1] = 0x00;
-				slot->current_cmd[2] = 0;
-				slot->current_cmd[3] = 0;
-				slot->current_cmd[4] = 0;
-				slot->current_cmd[5] = 0;
-				slot->current_cmd[6] = 0;
-				slot->current_cmd[2 + slot->id] = TRANSLATE_FORCE(parameters->level);
-				break;
-			case FF_SPRING:
-				d1 = SCALE_VALUE_U16(((parameters->d1) + 0x8000) & 0xffff, 11);
-				d2 = SCALE_VALUE_U16(((parameters->d2) + 0x8000) & 0xffff, 11);
-				s1 = parameters->k1 < 0;
-				s2 = parameters->k2 < 0;
-				k1 = abs(parameters->k1);
-				k2 = abs(parameters->k2);
-				if (k1 < 2048) {
-					d1 = 0;
-				} else {
-					k1 -= 2048;
-				}
-				if (k2 < 2048) {
-					d2 = 2047;
-				} else {
-					k2 -= 2048;
-				}
-				slot->current_cmd[1] = 0x0b;
-				slot->current_cmd[2] = d1 >> 3;
-				slot->current_cmd[3] = d2 >> 3;
-				slot->current_cmd[4] = (SCALE_COEFF(k2, 4) << 4) + SCALE_COEFF(k1, 4);
-				slot->current_cmd[5] = ((d2 & 7) << 5) + ((d1 & 7) << 1) + (s2 << 4) + s1;
-				slot->current_cmd[6] = SCALE_VALUE_U16(parameters->clip, 8);
-				break;
-			case FF_DAMPER:
-				s1 = parameters->k1 < 0;
-				s2 = parameters->k2 < 0;
-				slot->current_cmd[1] = 0x0c;
-				slot->current_cmd[2] = SCALE_COEFF(parameters->k1, 4);
-				slot->current_cmd[3] = s1;
-				slot->current_cmd[4] = SCALE_COEFF(parameters->k2, 4);
-				slot->current_cmd[5] = s2;
-				slot->current_cmd[6] = SCALE_VALUE_U16(parameters->clip, 8);
-				break;
-			case FF_FRICTION:
-				s1 = parameters->k1 < 0;
-				s2 = parameters->k2 < 0;
-				slot->current_cmd[1] = 0x0e;
-				slot->current_cmd[2] = SCALE_COEFF(parameters->k1, 8);
-				slot->current_cmd[3] = SCALE_COEFF(parameters->k2, 8);
-				slot->current_cmd[4] = SCALE_VALUE_U16(parameters->clip, 8);
-				slot->current_cmd[5] = (s2 << 4) + s1;
-				slot->current_cmd[6] = 0;
-				break;
-		}
+	atomic_dec(&output->inflight);
+	clear_bit(i, &output->busy);
+}
+
+/* Submit a command through its own output report without touching the
+ * shared HID report. Only used while the usbhid queue is empty so that
+ * commands can't overtake the ones already queued there. Returns 0 when the
+ * command has been submitted, the caller falls back to lg4ff_send_cmd
+ * otherwise. */
+static int lg4ff_output_cmd(struct lg4ff_device_entry *entry, int index, const u8 *cmd)
+{
+	struct lg4ff_output *output = &entry->output;
+	struct urb *urb = output->urbs[index];
+
+	if (!output->enabled || lg4ff_queue_depth(entry->hid->driver_data)) {
+		return -EAGAIN;
 	}
 
-	if (memcmp(original_cmd, slot->current_cmd, sizeof(original_cmd))) {
-		slot->is_updated = 1;
+	if (test_and_set_bit(index, &output->busy)) {
+		return -EBUSY;
+	}
+
+	memcpy(output->bufs[index], cmd, LG4FF_OUTPUT_SIZE);
+	atomic_inc(&output->inflight);
+	if (usb_submit_urb(urb, GFP_ATOMIC)) {
+		atomic_dec(&output->inflight);
+		clear_bit(index, &output->busy);
+		return -EIO;
 	}
+
+	entry->stats.direct++;
+	trace_lg4ff_send(entry->hid, cmd);
+
+	return 0;
 }
 
-static __always_inline int lg4ff_calculate_constant(struct lg4ff_effect_state *state)
+static void lg4ff_free_output(struct lg4ff_device_entry *entry)
 {
-	int level_sign;
-	int level = state->effect.u.constant.level;
-	int d, t;
+	struct lg4ff_output *output = &entry->output;
+	int i;
 
-	if (state->time_playing < state->envelope->attack_length) {
-		level_sign = level < 0 ? -1 : 1;
-		d = level - level_sign * state->envelope->attack_level;
-		level = level_sign * state->envelope->attack_level + d * state->time_playing / state->envelope->attack_length;
-	} else if (state->effect.replay.length) {
-		t = state->time_playing - state->effect.replay.length + state->envelope->fade_length;
-		if (t > 0) {
-			level_sign = level < 0 ? -1 : 1;
-			d = level - level_sign * state->envelope->fade_level;
-			level = level - d * t / state->envelope->fade_length;
+	output->enabled = 0;
+	for (i = 0; i < LG4FF_OUTPUTS; i++) {
+		if (output->urbs[i]) {
+			usb_poison_urb(output->urbs[i]);
+			usb_free_urb(output->urbs[i]);
+			output->urbs[i] = NULL;
 		}
+		kfree(output->bufs[i]);
+		output->bufs[i] = NULL;
 	}
-
-	return state->direction_gain * level / 0x7fff;
 }
 
-static __always_inline int lg4ff_calculate_ramp(struct lg4ff_effect_state *state)
+/* The output reports share the endpoint and interval of the usbhid output
+ * URB. Without an interrupt out endpoint everything goes through usbhid. */
+static void lg4ff_init_output(struct lg4ff_device_entry *entry)
 {
-	struct ff_ramp_effect *ramp = &state->effect.u.ramp;
-	int level_sign;
-	int level = INT_MAX;
-	int d, t;
-
-	if (state->time_playing < state->envelope->attack_length) {
-		level = ramp->start_level;
-		level_sign =  level < 0 ? -1 : 1;
-		t = state->envelope->attack_length - state->time_playing;
-		d = level - level_sign * state->envelope->attack_level;
-		level = level_sign * state->envelope->attack_level + d * t / state->envelope->attack_length;
-	} else if (state->effect.replay.length && state->time_playing >= state->effect.replay.length - state->envelope->fade_length) {
-		level = ramp->end_level;
-		level_sign = level < 0 ? -1 : 1;
-		t = state->time_playing - state->effect.replay.length + state->envelope->fade_length;
-		d = level_sign * state->envelope->fade_level - level;
-		level = level - d * t / state->envelope->fade_length;
-	} else {
-		t = state->time_playing - state->envelope->attack_length;
-		level = ramp->start_level + ((t * state->slope) >> 16);
+	struct usbhid_device *usbhid = entry->hid->driver_data;
+	struct lg4ff_output *output = &entry->output;
+	struct urb *urb;
+	int i;
+
+	atomic_set(&output->inflight, 0);
+
+	if (!direct_output || !usbhid->urbout || entry->report->id
+			|| hid_report_len(entry->report) != LG4FF_OUTPUT_SIZE) {
+		return;
+	}
+
+	for (i = 0; i < LG4FF_OUTPUTS; i++) {
+		output->bufs[i] = kzalloc(LG4FF_OUTPUT_SIZE, GFP_KERNEL);
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!output->bufs[i] || !urb) {
+			usb_free_urb(urb);
+			hid_warn(entry->hid, "Unable to allocate output reports, using the usbhid queue\n");
+			lg4ff_free_output(entry);
+			return;
+		}
+		usb_fill_int_urb(urb, hid_to_usb_dev(entry->hid), usbhid->urbout->pipe,
+				output->bufs[i], LG4FF_OUTPUT_SIZE, lg4ff_output_complete, entry, 0);
+		urb->interval = usbhid->urbout->interval;
+		output->urbs[i] = urb;
 	}
 
-	return state->direction_gain * level / 0x7fff;
+	output->enabled = 1;
 }
 
-static __always_inline int lg4ff_calculate_periodic(struct lg4ff_effect_state *state)
+#ifdef CONFIG_DEBUG_FS
+static void lg4ff_capture_add(struct lg4ff_device_entry *entry, int kind, const void *data, size_t size, const unsigned long now)
 {
-	struct ff_periodic_effect *periodic = &state->effect.u.periodic;
-	int magnitude = periodic->magnitude;
-	int magnitude_sign = magnitude < 0 ? -1 : 1;
-	int level = periodic->offset;
-	int d, t;
+	struct lg4ff_capture *capture = &entry->capture;
+	struct lg4ff_capture_record *record;
+	unsigned long flags;
 
-	if (state->time_playing < state->envelope->attack_length) {
-		d = magnitude - magnitude_sign * state->envelope->attack_level;
-		magnitude = magnitude_sign * state->envelope->attack_level + d * state->time_playing / state->envelope->attack_length;
-	} else if (state->effect.replay.length) {
-		t = state->time_playing - state->effect.replay.length + state->envelope->fade_length;
-		if (t > 0) {
-			d = magnitude - magnitude_sign * state->envelope->fade_level;
-			magnitude = magnitude - d * t / state->envelope->fade_length;
-		}
+	spin_lock_irqsave(&capture->lock, flags);
+	if (capture->active) {
+		record = &capture->records[capture->head++ & (LG4FF_CAPTURE_SIZE - 1)];
+		record->time = now;
+		record->kind = kind;
+		memcpy(&record->data, data, size);
 	}
+	spin_unlock_irqrestore(&capture->lock, flags);
+}
 
-	switch (periodic->waveform) {
-		case FF_SINE:
-			level += fixp_sin16(state->phase) * magnitude / 0x7fff;
-			break;
-		case FF_SQUARE:
-			level += (state->phase < 180 ? 1 : -1) * magnitude;
-			break;
-		case FF_TRIANGLE:
-			level += abs(state->phase * magnitude * 2 / 360 - magnitude) * 2 - magnitude;
-			break;
-		case FF_SAW_UP:
-			level += state->phase * magnitude * 2 / 360 - magnitude;
-			break;
-		case FF_SAW_DOWN:
-			level += magnitude - state->phase * magnitude * 2 / 360;
-			break;
+static __always_inline void lg4ff_capture_upload(struct lg4ff_device_entry *entry, const struct ff_effect *effect, const unsigned long now)
+{
+	if (unlikely(READ_ONCE(entry->capture.active))) {
+		lg4ff_capture_add(entry, LG4FF_CAPTURE_UPLOAD, effect, sizeof(*effect), now);
 	}
-
-	return state->direction_gain * level / 0x7fff;
 }
 
-static __always_inline void lg4ff_calculate_spring(struct lg4ff_effect_state *state, struct lg4ff_effect_parameters *parameters)
+static __always_inline void lg4ff_capture_play(struct lg4ff_device_entry *entry, int effect_id, int value, const unsigned long now)
 {
-	struct ff_condition_effect *condition = &state->effect.u.condition[0];
+	int play[2] = {effect_id, value};
 
-	parameters->d1 = ((int)condition->center) - condition->deadband / 2;
-	parameters->d2 = ((int)condition->center) + condition->deadband / 2;
-	parameters->k1 = condition->left_coeff;
-	parameters->k2 = condition->right_coeff;
-	parameters->clip = (unsigned)condition->right_saturation;
+	if (unlikely(READ_ONCE(entry->capture.active))) {
+		lg4ff_capture_add(entry, LG4FF_CAPTURE_PLAY, play, sizeof(play), now);
+	}
 }
 
-static __always_inline void lg4ff_calculate_resistance(struct lg4ff_effect_state *state, struct lg4ff_effect_parameters *parameters)
+static __always_inline void lg4ff_capture_cmd(struct lg4ff_device_entry *entry, const u8 *cmd, const unsigned long now)
 {
-	struct ff_condition_effect *condition = &state->effect.u.condition[0];
-
-	parameters->k1 = condition->left_coeff;
-	parameters->k2 = condition->right_coeff;
-	parameters->clip = (unsigned)condition->right_saturation;
+	if (unlikely(READ_ONCE(entry->capture.active))) {
+		lg4ff_capture_add(entry, LG4FF_CAPTURE_CMD, cmd, 7, now);
+	}
 }
 
-static __always_inline struct ff_envelope *lg4ff_effect_envelope(struct ff_effect *effect)
+/* Called by the timer with timer_lock held */
+static __always_inline void lg4ff_telemetry_add(struct lg4ff_device_entry *entry,
+		const struct lg4ff_effect_parameters *parameters, int ffb_level, const unsigned long now)
 {
-	switch (effect->type) {
-		case FF_CONSTANT:
-			return &effect->u.constant.envelope;
-		case FF_RAMP:
-			return &effect->u.ramp.envelope;
-		case FF_PERIODIC:
-			return &effect->u.periodic.envelope;
+	struct lg4ff_telemetry *telemetry = entry->telemetry;
+	struct lg4ff_telemetry_record *record;
+	u32 head;
+	int i;
+
+	if (likely(!telemetry)) {
+		return;
 	}
 
-	return NULL;
+	head = telemetry->head;
+	record = (void *)telemetry + LG4FF_TELEMETRY_OFFSET;
+	record += head & (LG4FF_TELEMETRY_RECORDS - 1);
+
+	WRITE_ONCE(record->seq, record->seq + 1);
+	smp_wmb();
+	record->index = head;
+	record->time = now;
+	record->level = parameters[0].level;
+	record->clipped = abs(parameters[0].level) > 0x7fff;
+	record->ffb_level = ffb_level;
+	record->peak_ffb_level = entry->peak_ffb_level;
+	record->position = entry->motion_sample.position;
+	record->velocity = lg4ff_motion_velocity(&entry->motion_sample);
+	for (i = 0; i < 4; i++) {
+		record->slots[i].level = parameters[i].level;
+		record->slots[i].k1 = parameters[i].k1;
+		record->slots[i].k2 = parameters[i].k2;
+		record->slots[i].clip = parameters[i].clip;
+	}
+	smp_wmb();
+	WRITE_ONCE(record->seq, record->seq + 1);
+	smp_store_release(&telemetry->head, head + 1);
 }
+#else
+static __always_inline void lg4ff_capture_upload(struct lg4ff_device_entry *entry, const struct ff_effect *effect, const unsigned long now) {}
+static __always_inline void lg4ff_capture_play(struct lg4ff_device_entry *entry, int effect_id, int value, const unsigned long now) {}
+static __always_inline void lg4ff_capture_cmd(struct lg4ff_device_entry *entry, const u8 *cmd, const unsigned long now) {}
+static __always_inline void lg4ff_telemetry_add(struct lg4ff_device_entry *entry,
+		const struct lg4ff_effect_parameters *parameters, int ffb_level, const unsigned long now) {}
+#endif
 
-static __always_inline void lg4ff_update_state(struct lg4ff_effect_state *state, const unsigned long now)
+/* The thread keeps ownership of the timer while it runs a tick */
+static __always_inline int lg4ff_timer_active(struct lg4ff_device_entry *entry)
 {
-	struct ff_effect *effect = &state->effect;
-	unsigned long phase_time;
+	return hrtimer_active(&entry->hrtimer) || READ_ONCE(entry->thread_ticking);
+}
 
-	if (!__test_and_set_bit(FF_EFFECT_ALLSET, &state->flags)) {
-		state->play_at = state->start_at + effect->replay.delay;
-		if (!test_bit(FF_EFFECT_UPDATING, &state->flags)) {
-			state->updated_at = state->play_at;
-		}
-		state->direction_gain = fixp_sin16(effect->direction * 360 / 0x10000);
-		if (effect->type == FF_PERIODIC) {
-			state->phase_adj = effect->u.periodic.phase * 360 / effect->u.periodic.period;
+/* Queue the commands for a device setting. The timer sends them after the
+ * slots, the work item sends them while the timer is idle and picks up any
+ * left when it stops. */
+static void lg4ff_queue_control(struct lg4ff_device_entry *entry, int kind, u8 cmd[][7], int count)
+{
+	struct lg4ff_control *control = &entry->controls[kind];
+	unsigned long flags;
+
+	spin_lock_irqsave(&entry->control_lock, flags);
+	memcpy(control->cmd, cmd, count * sizeof(control->cmd[0]));
+	control->count = count;
+	control->is_updated = 1;
+	spin_unlock_irqrestore(&entry->control_lock, flags);
+
+	mod_delayed_work(system_wq, &entry->control_work,
+			lg4ff_timer_active(entry) ? msecs_to_jiffies(LG4FF_CTRL_DELAY) : 0);
+}
+
+/* Send the pending controls of at most limit kinds. Returns how many kinds
+ * were sent. */
+static int lg4ff_send_controls(struct lg4ff_device_entry *entry, int limit)
+{
+	struct lg4ff_control *control;
+	unsigned long flags;
+	int sent = 0;
+	int i, j;
+
+	spin_lock_irqsave(&entry->control_lock, flags);
+	for (i = 0; i < LG4FF_CTRL_COUNT && sent < limit; i++) {
+		control = &entry->controls[i];
+		if (!control->is_updated) {
+			continue;
 		}
-		if (effect->replay.length) {
-			state->stop_at = state->play_at + effect->replay.length;
+		control->is_updated = 0;
+		for (j = 0; j < control->count; j++) {
+			if (lg4ff_output_cmd(entry, LG4FF_OUTPUT_CONTROL, control->cmd[j])) {
+				lg4ff_send_cmd(entry, control->cmd[j]);
+			}
 		}
+		sent++;
 	}
+	spin_unlock_irqrestore(&entry->control_lock, flags);
 
-	if (__test_and_clear_bit(FF_EFFECT_UPDATING, &state->flags)) {
-		__clear_bit(FF_EFFECT_PLAYING, &state->flags);
-		state->play_at = state->updated_at + effect->replay.delay;
-		state->direction_gain = fixp_sin16(effect->direction * 360 / 0x10000);
-		if (effect->replay.length) {
-			state->stop_at = state->updated_at + effect->replay.length;
-		}
-		if (effect->type == FF_PERIODIC) {
-			state->phase_adj = state->phase;
-		}
+	return sent;
+}
+
+static void lg4ff_control_work(struct work_struct *work)
+{
+	struct lg4ff_device_entry *entry = container_of(to_delayed_work(work), struct lg4ff_device_entry, control_work);
+
+	lg4ff_send_controls(entry, LG4FF_CTRL_COUNT);
+}
+
+/* Slot commands with the same operation and parameters can be sent as one
+ * command addressing all the slots at once */
+static __always_inline int lg4ff_cmd_mergeable(const u8 *cmd, const u8 *other)
+{
+	return (cmd[0] & 0xf) == (other[0] & 0xf) && !memcmp(&cmd[1], &other[1], 6);
+}
+
+#define LG4FF_SIGN_FLIP(a, b) (((a) < 0) != ((b) < 0))
+
+/* Largest change of the slot values since the last command sent, in 256ths
+ * of the range of each value. The command bytes pack several values together
+ * so they're compared decoded. Returns -1 when a value changed sign. */
+static __always_inline int lg4ff_slot_delta(const struct lg4ff_slot *slot)
+{
+	const struct lg4ff_effect_parameters *cur = &slot->parameters;
+	const struct lg4ff_effect_parameters *sent = &slot->sent_parameters;
+	int delta;
+
+	switch (slot->effect_type) {
+		case FF_CONSTANT:
+			if (LG4FF_SIGN_FLIP(cur->level, sent->level)) {
+				return -1;
+			}
+			delta = abs(cur->level - sent->level);
+			break;
+		case FF_PERIODIC:
+			if (LG4FF_SIGN_FLIP(cur->level, sent->level) || LG4FF_SIGN_FLIP(cur->low_level, sent->low_level)
+					|| cur->loops != sent->loops) {
+				return -1;
+			}
+			delta = max(abs(cur->level - sent->level), abs(cur->low_level - sent->low_level));
+			break;
+		default:
+			if (LG4FF_SIGN_FLIP(cur->k1, sent->k1) || LG4FF_SIGN_FLIP(cur->k2, sent->k2)) {
+				return -1;
+			}
+			delta = max(abs(cur->k1 - sent->k1), abs(cur->k2 - sent->k2));
+			delta = max(delta, abs(cur->d1 - sent->d1));
+			delta = max(delta, abs(cur->d2 - sent->d2));
+			delta = max(delta, abs((int)cur->clip - (int)sent->clip));
 	}
 
-	state->envelope = lg4ff_effect_envelope(effect);
+	return delta >> 8;
+}
+
+/* Changes smaller than the slot threshold are held back until they add up or
+ * the hysteresis deadline passes. Starting or stopping the slot, changing its
+ * effect type or the sign of a value always goes through. */
+static __always_inline int lg4ff_slot_due(struct lg4ff_device_entry *entry, struct lg4ff_slot *slot, const unsigned long now)
+{
+	int delta;
 
-	state->slope = 0;
-	if (effect->type == FF_RAMP && effect->replay.length) {
-		state->slope = ((effect->u.ramp.end_level - effect->u.ramp.start_level) << 16) / (effect->replay.length - state->envelope->attack_length - state->envelope->fade_length);
+	if (!slot->threshold || ((slot->current_cmd[0] & 0xf) == 3) != ((slot->sent_cmd[0] & 0xf) == 3)
+			|| slot->current_cmd[1] != slot->sent_cmd[1]) {
+		return 1;
 	}
 
-	if (!test_bit(FF_EFFECT_PLAYING, &state->flags) && time_after_eq(now,
-				state->play_at) && (effect->replay.length == 0 ||
-					time_before(now, state->stop_at))) {
-		__set_bit(FF_EFFECT_PLAYING, &state->flags);
+	delta = lg4ff_slot_delta(slot);
+	if (delta < 0) {
+		return 1;
 	}
 
-	if (test_bit(FF_EFFECT_PLAYING, &state->flags)) {
-		state->time_playing = time_diff(now, state->play_at);
-		if (effect->type == FF_PERIODIC) {
-			phase_time = time_diff(now, state->updated_at);
-			state->phase = (phase_time % effect->u.periodic.period) * 360 / effect->u.periodic.period;
-			state->phase += state->phase_adj % 360;
-		}
+	if (time_diff(now, slot->sent_at) >= entry->hysteresis_time) {
+		return 1;
 	}
+
+	return delta >= slot->threshold;
 }
 
-static __always_inline int lg4ff_timer(struct lg4ff_device_entry *entry)
+static __always_inline void lg4ff_slot_sent(struct lg4ff_slot *slot, const unsigned long now)
 {
-	struct usbhid_device *usbhid = entry->hid->driver_data;
-	struct lg4ff_slot *slot;
-	struct lg4ff_effect_state *state;
-	struct lg4ff_effect_parameters parameters[4];
-	unsigned long jiffies_now = jiffies;
-	unsigned long now = JIFFIES2MS(jiffies_now);
-	unsigned long flags;
-	unsigned gain;
-	int current_period;
-	int count;
-	int effect_id;
-	int i;
-	int ffb_level;
-#ifdef CONFIG_LEDS_CLASS
-	static int leds_timer = 0;
-	static int leds_level = 0;
-	u8 led_states;
-#endif
-
-	if (timer_mode > 0 && usbhid->outhead != usbhid->outtail) {
-		current_period = timer_msecs;
-		if (timer_mode == 1) {
-			timer_msecs *= 2;
-			hid_info(entry->hid, "Commands stacking up, increasing timer period to %d ms.", timer_msecs);
-		} else {
-			DEBUG("Commands stacking up, delaying timer.");
-		}
-		return current_period;
-	}
+	slot->is_updated = 0;
+	memcpy(slot->sent_cmd, slot->current_cmd, sizeof(slot->sent_cmd));
+	slot->sent_parameters = slot->parameters;
+	slot->sent_at = now;
+}
 
-	memset(parameters, 0, sizeof(parameters));
+/* Take one command from the budget of the hub. Called with timer_lock held. */
+static __always_inline int lg4ff_bus_take(struct lg4ff_device_entry *entry, const unsigned long now)
+{
+	struct lg4ff_bus_group *group = entry->bus_group;
+	unsigned long elapsed;
+	int taken;
 
-	gain = (unsigned)entry->wdata.master_gain * entry->wdata.gain / 0xffff;
+	if (!group) {
+		return 1;
+	}
 
-	spin_lock_irqsave(&entry->timer_lock, flags);
+	spin_lock(&group->lock);
+	/* Another wheel of the group may have refilled with a later time */
+	if (time_after(now, group->refill_at)) {
+		elapsed = min(time_diff(now, group->refill_at), (unsigned long)USEC_PER_SEC);
+		group->refill_at = now;
+		group->tokens = min(group->tokens + elapsed * group->budget,
+				(unsigned long)group->budget * LG4FF_BUS_WINDOW * USEC_PER_MSEC);
+	}
+	taken = group->tokens >= USEC_PER_MSEC;
+	if (taken) {
+		group->tokens -= USEC_PER_MSEC;
+	}
+	spin_unlock(&group->lock);
 
-	count = entry->effects_used;
+	return taken;
+}
 
-	for (effect_id = 0; effect_id < LG4FF_MAX_EFFECTS; effect_id++) {
+/* Send the updated slots in one burst, constant force (slot 0) first.
+ * Each slot goes out through its own output report, a slot whose previous
+ * command is still in flight keeps its update for a later tick. Returns the
+ * number of commands sent. */
+static int lg4ff_send_slots(struct lg4ff_device_entry *entry)
+{
+	struct lg4ff_slot *slot;
+	unsigned long now = lg4ff_now();
+	u8 cmd[7];
+	int count = 0;
+	int i, j;
 
-		if (!count) {
+	for (i = 0; i < 4; i++) {
+		slot = &entry->slots[i];
+		if (!slot->is_updated || lg4ff_output_busy(entry, i)) {
+			continue;
+		}
+		if (!lg4ff_slot_due(entry, slot, now)) {
+			entry->stats.deferred++;
+			continue;
+		}
+		if (!lg4ff_bus_take(entry, now)) {
+			entry->stats.throttled++;
 			break;
 		}
+		lg4ff_slot_sent(slot, now);
+		memcpy(cmd, slot->current_cmd, sizeof(cmd));
+		for (j = i + 1; j < 4; j++) {
+			slot = &entry->slots[j];
+			if (slot->is_updated && lg4ff_cmd_mergeable(cmd, slot->current_cmd)
+					&& lg4ff_slot_due(entry, slot, now)) {
+				cmd[0] |= slot->current_cmd[0] & 0xf0;
+				lg4ff_slot_sent(slot, now);
+			}
+		}
+		if (lg4ff_output_cmd(entry, i, cmd)) {
+			lg4ff_send_cmd(entry, cmd);
+		}
+		lg4ff_capture_cmd(entry, cmd, now);
+		count++;
+	}
 
-		state = &entry->states[effect_id];
+	return count;
+}
 
-		if (!test_bit(FF_EFFECT_STARTED, &state->flags)) {
-			continue;
-		}
+/* Slots work as mailboxes: the command is rebuilt every tick and only the
+ * latest one gets sent once the output queue has room for it. Returns
+ * whether the command changed. */
+static int lg4ff_update_slot(struct lg4ff_slot *slot, struct lg4ff_effect_parameters *parameters)
+{
+	u8 original_cmd[7];
+	u8 native = slot->effect_type == FF_PERIODIC ? LG4FF_NATIVE_SQUARE : 0x00;
+	int d1;
+	int d2;
+	int k1;
+	int k2;
+	int s1;
+	int s2;
 
-		count--;
+	memcpy(original_cmd, slot->current_cmd, sizeof(original_cmd));
 
-		if (test_bit(FF_EFFECT_ALLSET, &state->flags)) {
-			if (state->effect.replay.length && time_after_eq(now, state->stop_at)) {
-				STOP_EFFECT(state);
-				if (!--state->count) {
-					entry->effects_used--;
-					continue;
-				}
-				__set_bit(FF_EFFECT_STARTED, &state->flags);
-				state->start_at = state->stop_at;
-			}
+	if ((original_cmd[0] & 0xf) == 1) {
+		original_cmd[0] = (original_cmd[0] & 0xf0) + 0xc;
+	}
+
+	if (slot->effect_type == FF_CONSTANT || slot->effect_type == FF_PERIODIC) {
+		/* Switching between the constant force and the native square
+		 * wave takes a new download */
+		if (slot->cmd_op == 0 || slot->current_cmd[1] != native) {
+			slot->cmd_op = 1;
+		} else {
+			slot->cmd_op = 0xc;
+		}
+	} else {
+		if (parameters->clip == 0 || slot->effect_type == 0) {
+			slot->cmd_op = 3;
+		} else if (slot->cmd_op == 3) {
+			slot->cmd_op = 1;
+		} else {
+			slot->cmd_op = 0xc;
 		}
+	}
 
-		lg4ff_update_state(state, now);
+	/* A pending download command hasn't reached the device yet, keep
+	 * downloading instead of refreshing when superseding it */
+	if (slot->is_updated && slot->cmd_op == 0xc && (slot->current_cmd[0] & 0xf) == 1) {
+		slot->cmd_op = 1;
+	}
 
-		if (!test_bit(FF_EFFECT_PLAYING, &state->flags)) {
-			continue;
-		}
+	slot->current_cmd[0] = (0x10 << slot->id) + slot->cmd_op;
 
-		switch (state->effect.type) {
+	if (slot->cmd_op == 3) {
+		slot->current_cmd[1] = 0;
+		slot->current_cmd[2] = 0;
+		slot->current_cmd[3] = 0;
+		slot->current_cmd[4] = 0;
+		slot->current_cmd[5] = 0;
+		slot->current_cmd[6] = 0;
+	} else {
+		switch (slot->effect_type) {
 			case FF_CONSTANT:
-				parameters[0].level += lg4ff_calculate_constant(state);
-				break;
-			case FF_RAMP:
-				parameters[0].level += lg4ff_calculate_ramp(state);
+				slot->current_cmd[1] = 0x00;
+				slot->current_cmd[2] = 0;
+				slot->current_cmd[3] = 0;
+				slot->current_cmd[4] = 0;
+				slot->current_cmd[5] = 0;
+				slot->current_cmd[6] = 0;
+				slot->current_cmd[2 + slot->id] = TRANSLATE_FORCE(parameters->level);
 				break;
 			case FF_PERIODIC:
-				parameters[0].level += lg4ff_calculate_periodic(state);
+				/* Rectangle wave: both levels and how many device
+				 * loops each of them lasts */
+				slot->current_cmd[1] = LG4FF_NATIVE_SQUARE;
+				slot->current_cmd[2] = TRANSLATE_FORCE(parameters->level);
+				slot->current_cmd[3] = TRANSLATE_FORCE(parameters->low_level);
+				slot->current_cmd[4] = parameters->loops;
+				slot->current_cmd[5] = parameters->loops;
+				slot->current_cmd[6] = 0;
 				break;
 			case FF_SPRING:
-				if (state->slot != 0) {
-					lg4ff_calculate_spring(state, &parameters[state->slot]);
+				d1 = SCALE_VALUE_U16(((parameters->d1) + 0x8000) & 0xffff, 11);
+				d2 = SCALE_VALUE_U16(((parameters->d2) + 0x8000) & 0xffff, 11);
+				s1 = parameters->k1 < 0;
+				s2 = parameters->k2 < 0;
+				k1 = abs(parameters->k1);
+				k2 = abs(parameters->k2);
+				if (k1 < 2048) {
+					d1 = 0;
+				} else {
+					k1 -= 2048;
 				}
-				break;
-			case FF_DAMPER:
-			case FF_FRICTION:
-			case FF_INERTIA:
-				if (state->slot != 0) {
-					lg4ff_calculate_resistance(state, &parameters[state->slot]);
+				if (k2 < 2048) {
+					d2 = 2047;
+				} else {
+					k2 -= 2048;
 				}
-		}
-	}
-
-	spin_unlock_irqrestore(&entry->timer_lock, flags);
-
-	parameters[0].level = (long)parameters[0].level * gain / 0xffff;
-
-	ffb_level = abs(parameters[0].level);
-	for (i = 1; i < 4; i++) {
-		parameters[i].k1 = (long)parameters[i].k1 * gain / 0xffff;
-		parameters[i].k2 = (long)parameters[i].k2 * gain / 0xffff;
-		switch (entry->slots[i].effect_type) {
-			case FF_SPRING:
-				parameters[i].clip = parameters[i].clip * spring_level / 100;
+				slot->current_cmd[1] = 0x0b;
+				slot->current_cmd[2] = d1 >> 3;
+				slot->current_cmd[3] = d2 >> 3;
+				slot->current_cmd[4] = (SCALE_COEFF(k2, 4) << 4) + SCALE_COEFF(k1, 4);
+				slot->current_cmd[5] = ((d2 & 7) << 5) + ((d1 & 7) << 1) + (s2 << 4) + s1;
+				slot->current_cmd[6] = SCALE_VALUE_U16(parameters->clip, 8);
 				break;
 			case FF_DAMPER:
-				parameters[i].clip = parameters[i].clip * damper_level / 100;
+				s1 = parameters->k1 < 0;
+				s2 = parameters->k2 < 0;
+				slot->current_cmd[1] = 0x0c;
+				slot->current_cmd[2] = SCALE_COEFF(parameters->k1, 4);
+				slot->current_cmd[3] = s1;
+				slot->current_cmd[4] = SCALE_COEFF(parameters->k2, 4);
+				slot->current_cmd[5] = s2;
+				slot->current_cmd[6] = SCALE_VALUE_U16(parameters->clip, 8);
 				break;
 			case FF_FRICTION:
-				parameters[i].clip = parameters[i].clip * friction_level / 100;
+				s1 = parameters->k1 < 0;
+				s2 = parameters->k2 < 0;
+				slot->current_cmd[1] = 0x0e;
+				slot->current_cmd[2] = SCALE_COEFF(parameters->k1, 8);
+				slot->current_cmd[3] = SCALE_COEFF(parameters->k2, 8);
+				slot->current_cmd[4] = SCALE_VALUE_U16(parameters->clip, 8);
+				slot->current_cmd[5] = (s2 << 4) + s1;
+				slot->current_cmd[6] = 0;
 				break;
 		}
-		parameters[i].clip = parameters[i].clip * gain / 0xffff;
-		ffb_level += parameters[i].clip * 0x7fff / 0xffff;
-	}
-	if (ffb_level > entry->peak_ffb_level) {
-		entry->peak_ffb_level = ffb_level;
 	}
 
-	for (i = 0; i < 4; i++) {
-		slot = &entry->slots[i];
-		lg4ff_update_slot(slot, &parameters[i]);
-		if (slot->is_updated) {
-			lg4ff_send_cmd(entry, slot->current_cmd);
-			slot->is_updated = 0;
-		}
-	}
+	slot->parameters = *parameters;
 
-#ifdef CONFIG_LEDS_CLASS
-	if (ffb_leds || leds_level > 0) {
-		if (ffb_level > leds_level) {
-			leds_level = ffb_level;
-		}
-		if (!ffb_leds || entry->effects_used == 0) {
-			leds_timer = 0;
-			leds_level = 0;
-		}
-		if (leds_timer == 0) {
-			leds_timer = 480 / timer_msecs;
-			if (leds_level < 2458) { // < 7.5%
-				led_states = 0;
-			} else if (leds_level < 8192) { // < 25%
-				led_states = 1;
-			} else if (leds_level < 16384) { // < 50%
-				led_states = 3;
-			} else if (leds_level < 24576) { // < 75%
-				led_states = 7;
-			} else if (leds_level < 29491) { // < 90%
-				led_states = 15;
-			} else if (leds_level <= 32768) { // <= 100%
-				led_states = 31;
-			} else if (leds_level < 36045) { // < 110%
-				led_states = 30;
-			} else if (leds_level < 40960) { // < 125%
-				led_states = 28;
-			} else if (leds_level < 49152) { // < 150%
-				led_states = 24;
-			} else {
-				led_states = 16;
-			}
-			lg4ff_set_leds(entry->hid, led_states);
-			leds_level = 0;
-		}
-		leds_timer--;
+	if (memcmp(original_cmd, slot->current_cmd, sizeof(original_cmd))) {
+		slot->is_updated = 1;
+		return 1;
 	}
-#endif
 
 	return 0;
 }
 
-static enum hrtimer_restart lg4ff_timer_hires(struct hrtimer *t)
+static __always_inline int lg4ff_calculate_envelope(struct lg4ff_effect_state *state)
 {
-	struct lg4ff_device_entry *entry = container_of(t, struct lg4ff_device_entry, hrtimer);
-	int delay_timer;
-	int overruns;
-
-	delay_timer = lg4ff_timer(entry);
+	struct lg4ff_effect_coeffs *coeffs = &state->coeffs;
+	unsigned long t = state->time_playing;
 
-	if (delay_timer) {
-		hrtimer_forward_now(&entry->hrtimer, ms_to_ktime(delay_timer));
-		return HRTIMER_RESTART;
+	if (t < coeffs->attack_length) {
+		return coeffs->attack_level + ((coeffs->attack_slope * (long)t) >> 32);
 	}
 
-	if (entry->effects_used) {
-		overruns = hrtimer_forward_now(&entry->hrtimer, ms_to_ktime(timer_msecs));
-		overruns--;
-		if (unlikely(profile && overruns > 0))
-			DEBUG("Overruns: %d", overruns);
-		return HRTIMER_RESTART;
-	} else {
-		if (unlikely(profile))
-			DEBUG("Stop timer.");
-		return HRTIMER_NORESTART;
+	if (coeffs->length && (long)t >= coeffs->fade_start) {
+		return coeffs->fade_level - ((coeffs->fade_slope * ((long)t - coeffs->fade_start)) >> 32);
 	}
+
+	return coeffs->level + ((coeffs->slope * (long)(t - coeffs->attack_length)) >> 32);
 }
 
-static void lg4ff_init_slots(struct lg4ff_device_entry *entry)
+static __always_inline int lg4ff_scale_direction(struct lg4ff_effect_state *state, int level)
 {
-	struct lg4ff_effect_parameters parameters;
-	u8 cmd[8] = {0};
-	int i;
+	return ((s64)level * state->coeffs.direction_gain) >> 16;
+}
 
-	// Set/unset fixed loop mode
-	cmd[0] = 0x0d;
-	cmd[1] = fixed_loop ? 1 : 0;
-	lg4ff_send_cmd(entry, cmd);
-
-	memset(&entry->states, 0, sizeof(entry->states));
-	memset(&entry->slots, 0, sizeof(entry->slots));
-	memset(&parameters, 0, sizeof(parameters));
-
-	entry->slots[0].effect_type = FF_CONSTANT;
+/* Linear interpolation between table entries, the phase is Q32 turns */
+static __always_inline int lg4ff_wave_lookup(const s16 *table, u32 phase)
+{
+	unsigned int i = phase >> (32 - LG4FF_WAVE_BITS);
+	int frac = (phase >> (17 - LG4FF_WAVE_BITS)) & 0x7fff;
 
-	for (i = 0; i < 4; i++) {
-		entry->slots[i].id = i;
-		lg4ff_update_slot(&entry->slots[i], &parameters);
-		lg4ff_send_cmd(entry, entry->slots[i].current_cmd);
-		entry->slots[i].is_updated = 0;
-	}
+	return table[i] + (((table[i + 1] - table[i]) * frac) >> 15);
 }
 
-static void lg4ff_stop_effects(struct lg4ff_device_entry *entry)
+static __always_inline int lg4ff_calculate_constant(struct lg4ff_effect_state *state)
 {
-	u8 cmd[7] = {0};
+	return lg4ff_scale_direction(state, lg4ff_calculate_envelope(state));
+}
 
-	cmd[0] = 0xf3;
-	lg4ff_send_cmd(entry, cmd);
+static __always_inline int lg4ff_calculate_ramp(struct lg4ff_effect_state *state)
+{
+	return lg4ff_scale_direction(state, lg4ff_calculate_envelope(state));
 }
 
-static int lg4ff_upload_effect(struct input_dev *dev, struct ff_effect *effect, struct ff_effect *old)
+static __always_inline int lg4ff_calculate_periodic(struct lg4ff_effect_state *state)
 {
-	struct hid_device *hid = input_get_drvdata(dev);
-	struct lg4ff_device_entry *entry;
-	struct lg4ff_effect_state *state;
-	unsigned long now = JIFFIES2MS(jiffies);
-	unsigned long flags;
+	struct ff_periodic_effect *periodic = &state->effect->u.periodic;
+	int magnitude = lg4ff_calculate_envelope(state);
+	int level = periodic->offset;
 
-	entry = lg4ff_get_device_entry(hid);
-	if (entry == NULL) {
-		return -EINVAL;
-	}
+	const s16 *wave = state->coeffs.wave;
+	u32 phase = state->phase;
+	int value = 0;
 
-	if (effect->type == FF_PERIODIC && effect->u.periodic.period == 0) {
-		return -EINVAL;
+	if (wave) {
+		value = lg4ff_wave_lookup(wave, phase);
+	} else {
+		switch (periodic->waveform) {
+			case FF_SQUARE:
+				value = phase < 0x80000000 ? 0x7fff : -0x7fff;
+				break;
+			case FF_TRIANGLE:
+				value = abs((int)(phase >> 16) - 0x8000) * 2 - 0x8000;
+				break;
+			case FF_SAW_UP:
+			case FF_SAW_DOWN:
+				value = (int)(phase >> 16) - 0x8000;
+				break;
+		}
 	}
 
-	state = &entry->states[effect->id];
-
-	if (test_bit(FF_EFFECT_STARTED, &state->flags) && effect->type != state->effect.type) {
-		return -EINVAL;
+	if (periodic->waveform == FF_SAW_DOWN) {
+		value = -value;
 	}
 
-	spin_lock_irqsave(&entry->timer_lock, flags);
+	level += (magnitude * value) >> 15;
 
-	state->effect = *effect;
+	return lg4ff_scale_direction(state, level);
+}
 
-	if (test_bit(FF_EFFECT_STARTED, &state->flags)) {
-		__set_bit(FF_EFFECT_UPDATING, &state->flags);
-		state->updated_at = now;
-	}
+/* Effects of the same type share a slot, their coefficients and
+ * saturations add up */
+static __always_inline void lg4ff_calculate_resistance(struct lg4ff_effect_state *state, struct lg4ff_effect_parameters *parameters)
+{
+	struct ff_condition_effect *condition = &state->effect->u.condition[0];
 
-	spin_unlock_irqrestore(&entry->timer_lock, flags);
+	parameters->k1 += condition->left_coeff;
+	parameters->k2 += condition->right_coeff;
+	parameters->clip = min(parameters->clip + condition->right_saturation, 0xffffU);
+	parameters->users++;
+}
 
-	return 0;
+/* Merged springs get the deadband bounds averaged by coefficient, the
+ * average is only worked out by lg4ff_merge_springs when there's more than
+ * one spring */
+static __always_inline void lg4ff_calculate_spring(struct lg4ff_effect_state *state, struct lg4ff_effect_parameters *parameters)
+{
+	struct ff_condition_effect *condition = &state->effect->u.condition[0];
+	unsigned int weight = abs(condition->left_coeff) + abs(condition->right_coeff) + 1;
+
+	parameters->d1 = ((int)condition->center) - condition->deadband / 2;
+	parameters->d2 = ((int)condition->center) + condition->deadband / 2;
+	parameters->d1_sum += (s64)parameters->d1 * weight;
+	parameters->d2_sum += (s64)parameters->d2 * weight;
+	parameters->weight += weight;
+	lg4ff_calculate_resistance(state, parameters);
 }
 
-static int lg4ff_play_effect(struct input_dev *dev, int effect_id, int value)
+/* Inertia opposes the wheel acceleration. It's played in the constant force
+ * slot since the wheels have no hardware inertia effect. */
+static __always_inline int lg4ff_calculate_inertia(struct lg4ff_effect_state *state, struct lg4ff_motion_sample *sample, u32 factor)
 {
-	struct hid_device *hid = input_get_drvdata(dev);
-	struct lg4ff_device_entry *entry;
-	struct lg4ff_effect_state *state;
-	unsigned long now = JIFFIES2MS(jiffies);
-	unsigned long flags;
-	int i;
+	struct ff_condition_effect *condition = &state->effect->u.condition[0];
+	int acceleration = clamp(lg4ff_motion_acceleration(sample) >> LG4FF_INERTIA_SHIFT, -0x8000, 0x7fff);
+	int d1 = ((int)condition->center) - condition->deadband / 2;
+	int d2 = ((int)condition->center) + condition->deadband / 2;
+	int force = 0;
+
+	if (acceleration < d1) {
+		force = ((s64)(d1 - acceleration) * condition->left_coeff) >> 15;
+		force = min(force, condition->left_saturation >> 1);
+	} else if (acceleration > d2) {
+		force = ((s64)(d2 - acceleration) * condition->right_coeff) >> 15;
+		force = max(force, -(condition->right_saturation >> 1));
+	}
 
-	entry = lg4ff_get_device_entry(hid);
-	if (entry == NULL) {
-		return -EINVAL;
+	return ((s64)force * factor) >> LG4FF_SCALE_SHIFT;
+}
+
+static __always_inline void lg4ff_merge_springs(struct lg4ff_effect_parameters *parameters)
+{
+	if (parameters->users > 1) {
+		parameters->d1 = div_s64(parameters->d1_sum, parameters->weight);
+		parameters->d2 = div_s64(parameters->d2_sum, parameters->weight);
 	}
+}
 
-	state = &entry->states[effect_id];
+static __always_inline struct ff_envelope *lg4ff_effect_envelope(struct ff_effect *effect)
+{
+	switch (effect->type) {
+		case FF_CONSTANT:
+			return &effect->u.constant.envelope;
+		case FF_RAMP:
+			return &effect->u.ramp.envelope;
+		case FF_PERIODIC:
+			return &effect->u.periodic.envelope;
+	}
 
-	spin_lock_irqsave(&entry->timer_lock, flags);
+	return NULL;
+}
 
-	if (value > 0) {
-		if (test_bit(FF_EFFECT_STARTED, &state->flags)) {
-			STOP_EFFECT(state);
-		} else {
-			entry->effects_used++;
-			if (!hrtimer_active(&entry->hrtimer)) {
-				hrtimer_start(&entry->hrtimer, ms_to_ktime(timer_msecs), HRTIMER_MODE_REL);
-				if (unlikely(profile))
-					DEBUG("Start timer.");
-			}
-			if ((state->effect.type == FF_SPRING || state->effect.type == FF_DAMPER
-					|| state->effect.type == FF_FRICTION || state->effect.type == FF_INERTIA)
-					&& state->slot == 0) {
-				/* Find a free slot */
-				for (i = 1; i < 4 && entry->slots[i].effect_type != 0; i++);
-				if (i < 4) {
-					state->slot = i;
-					entry->slots[i].effect_type = state->effect.type;
-
-					/* Cast unsupported effect types to "damper": this is what the Windows
-					* driver does.
-					* This is not physically plausible, but we are working with toy-strength
-					* wheels that won't let you feel more than "big value = wheel stuck" */
-					if (state->effect.type == FF_INERTIA
-							|| (state->effect.type == FF_FRICTION && !(entry->wdata.capabilities & LG4FF_CAP_FRICTION))) {
-						entry->slots[i].effect_type = FF_DAMPER;
-					}
+/* Fourier series of the waveforms with the same orientation as the exact
+ * ones, the shifted sine index gives the cosine terms of the triangle */
+static s64 lg4ff_wave_sample(int shape, int harmonics, int i)
+{
+	s64 sum = 0;
+	int k;
+
+	for (k = 1; k <= harmonics; k++) {
+		switch (shape) {
+			case LG4FF_WAVE_SQUARE:
+				if (k & 1) {
+					sum += lg4ff_sine_table[(i * k) % LG4FF_WAVE_SIZE] * 0x10000LL / k;
 				}
-			}
-		}
-		__set_bit(FF_EFFECT_STARTED, &state->flags);
-		state->start_at = now;
-		state->count = value;
-	} else {
-		if (test_bit(FF_EFFECT_STARTED, &state->flags)) {
-			STOP_EFFECT(state);
-			entry->effects_used--;
-			if (state->slot) {
-				entry->slots[state->slot].effect_type = 0;
-				state->slot = 0;
-			}
+				break;
+			case LG4FF_WAVE_TRIANGLE:
+				if (k & 1) {
+					sum += lg4ff_sine_table[(i * k + LG4FF_WAVE_SIZE / 4) % LG4FF_WAVE_SIZE] * 0x10000LL / (k * k);
+				}
+				break;
+			case LG4FF_WAVE_SAW:
+				sum -= lg4ff_sine_table[(i * k) % LG4FF_WAVE_SIZE] * 0x10000LL / k;
+				break;
 		}
 	}
 
-	spin_unlock_irqrestore(&entry->timer_lock, flags);
-
-	return 0;
+	return sum;
 }
 
-/* Recalculates X axis value accordingly to currently selected range */
-static s32 lg4ff_adjust_dfp_x_axis(s32 value, u16 range)
+static void lg4ff_init_wave_tables(void)
 {
-	u16 max_range;
-	s32 new_value;
+	s16 *table;
+	s64 peak;
+	int shape, level, harmonics, i;
 
-	if (range == 900)
-		return value;
-	else if (range == 200)
-		return value;
-	else if (range < 200)
-		max_range = 200;
-	else
-		max_range = 900;
+	mutex_lock(&lg4ff_wave_mutex);
+	if (lg4ff_wave_tables_ready) {
+		goto out;
+	}
 
-	new_value = 8192 + mult_frac(value - 8192, max_range, range);
-	if (new_value < 0)
-		return 0;
-	else if (new_value > 16383)
-		return 16383;
-	else
-		return new_value;
+	/* fixp_sin32_rad() needs at least one unit per degree */
+	for (i = 0; i < LG4FF_WAVE_SIZE; i++) {
+		lg4ff_sine_table[i] = fixp_sin32_rad(i * 360, LG4FF_WAVE_SIZE * 360) >> 16;
+	}
+	lg4ff_sine_table[LG4FF_WAVE_SIZE] = lg4ff_sine_table[0];
+
+	/* Normalized to their peak so that the overshoot never clips */
+	for (shape = 0; shape < 3; shape++) {
+		for (level = 0; level < LG4FF_WAVE_LEVELS; level++) {
+			table = lg4ff_wave_tables[shape][level];
+			harmonics = (2 << level) - 1;
+			peak = 1;
+			for (i = 0; i < LG4FF_WAVE_SIZE; i++) {
+				peak = max(peak, abs(lg4ff_wave_sample(shape, harmonics, i)));
+			}
+			for (i = 0; i < LG4FF_WAVE_SIZE; i++) {
+				table[i] = div64_s64(lg4ff_wave_sample(shape, harmonics, i) * 0x7fff, peak);
+			}
+			table[LG4FF_WAVE_SIZE] = table[0];
+		}
+	}
+
+	lg4ff_wave_tables_ready = true;
+out:
+	mutex_unlock(&lg4ff_wave_mutex);
 }
 
-int lg4ff_adjust_input_event(struct hid_device *hid, struct hid_field *field,
-			     struct hid_usage *usage, s32 value, struct lg_drv_data *drv_data)
+/* Harmonics above half the tick rate would alias into audible beats, use a
+ * band-limited table for waveforms too short to be rendered exactly */
+static const s16 *lg4ff_select_wave(int waveform, unsigned long period, unsigned long tick)
 {
-	struct lg4ff_device_entry *entry = drv_data->device_props;
-	s32 new_value = 0;
+	unsigned long harmonics = period / (2 * tick);
+	int shape;
+	int level;
 
-	if (!entry) {
-		hid_err(hid, "Device properties not found");
-		return 0;
+	switch (waveform) {
+		case FF_SINE:
+			return lg4ff_sine_table;
+		case FF_SQUARE:
+			shape = LG4FF_WAVE_SQUARE;
+			break;
+		case FF_TRIANGLE:
+			shape = LG4FF_WAVE_TRIANGLE;
+			break;
+		default:
+			shape = LG4FF_WAVE_SAW;
+			break;
 	}
 
-	switch (entry->wdata.product_id) {
-	case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
-		switch (usage->code) {
-		case ABS_X:
-			new_value = lg4ff_adjust_dfp_x_axis(value, entry->wdata.range);
-			input_event(field->hidinput->input, usage->type, usage->code, new_value);
-			return 1;
-		default:
-			return 0;
-		}
-	default:
-		return 0;
+	if (harmonics >= (2 << (LG4FF_WAVE_LEVELS - 1))) {
+		return NULL;
 	}
+
+	level = max(fls(harmonics + 1) - 2, 0);
+
+	return lg4ff_wave_tables[shape][level];
 }
 
-int lg4ff_raw_event(struct hid_device *hdev, struct hid_report *report,
-		u8 *rd, int size, struct lg_drv_data *drv_data)
+/* Called on upload, in process context, where divisions are cheap enough */
+static void lg4ff_precompute_effect(struct ff_effect *effect, struct lg4ff_effect_coeffs *coeffs, unsigned long tick)
 {
-	int offset;
-	struct lg4ff_device_entry *entry = drv_data->device_props;
+	struct ff_envelope *envelope = lg4ff_effect_envelope(effect);
+	unsigned long attack_length = 0;
+	unsigned long fade_length = 0;
+	int level_sign;
+	int level = 0;
+	int end_level;
+	long duration;
+	unsigned int loops;
 
-	if (!entry)
-		return 0;
+	memset(coeffs, 0, sizeof(*coeffs));
 
-	/* adjust HID report present combined pedals data */
-	if (entry->wdata.combine == 1) {
-		switch (entry->wdata.product_id) {
-		case USB_DEVICE_ID_LOGITECH_WHEEL:
-			rd[5] = rd[3];
-			rd[6] = 0x7F;
-			return 1;
-		case USB_DEVICE_ID_LOGITECH_WINGMAN_FG:
-		case USB_DEVICE_ID_LOGITECH_WINGMAN_FFG:
-		case USB_DEVICE_ID_LOGITECH_MOMO_WHEEL:
-		case USB_DEVICE_ID_LOGITECH_MOMO_WHEEL2:
-			rd[4] = rd[3];
-			rd[5] = 0x7F;
-			return 1;
-		case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
-			rd[5] = rd[4];
-			rd[6] = 0x7F;
-			return 1;
-		case USB_DEVICE_ID_LOGITECH_G25_WHEEL:
-		case USB_DEVICE_ID_LOGITECH_G27_WHEEL:
-			offset = 5;
+	coeffs->delay = MS2US(effect->replay.delay);
+	coeffs->length = MS2US(effect->replay.length);
+	coeffs->direction_gain = div_s64((s64)fixp_sin16(effect->direction * 360 / 0x10000) << 16, 0x7fff);
+
+	if (envelope == NULL) {
+		return;
+	}
+
+	attack_length = MS2US(envelope->attack_length);
+	fade_length = MS2US(envelope->fade_length);
+	coeffs->attack_length = attack_length;
+	coeffs->fade_start = (long)coeffs->length - (long)fade_length;
+
+	switch (effect->type) {
+		case FF_CONSTANT:
+			level = effect->u.constant.level;
 			break;
-		case USB_DEVICE_ID_LOGITECH_DFGT_WHEEL:
-		case USB_DEVICE_ID_LOGITECH_G29_WHEEL:
-		case USB_DEVICE_ID_LOGITECH_G923_WHEEL:
-			offset = 6;
+		case FF_PERIODIC:
+			level = effect->u.periodic.magnitude;
+			coeffs->phase_rate = div_u64(1ULL << 48, MS2US(effect->u.periodic.period));
+			coeffs->phase_adj = div_u64((u64)effect->u.periodic.phase << 32, effect->u.periodic.period);
+			coeffs->wave = lg4ff_select_wave(effect->u.periodic.waveform, MS2US(effect->u.periodic.period), tick);
 			break;
-		case USB_DEVICE_ID_LOGITECH_WII_WHEEL:
-			offset = 3;
+		case FF_RAMP:
+			level = effect->u.ramp.start_level;
 			break;
-		default:
-			return 0;
-		}
-
-		/* Compute a combined axis when wheel does not supply it */
-		rd[offset] = (0xFF + rd[offset] - rd[offset+1]) >> 1;
-		rd[offset+1] = 0x7F;
-		return 1;
 	}
 
-	if (entry->wdata.combine == 2) {
-		switch (entry->wdata.product_id) {
-			case USB_DEVICE_ID_LOGITECH_G25_WHEEL:
-			case USB_DEVICE_ID_LOGITECH_G27_WHEEL:
-				offset = 5;
-				break;
-			case USB_DEVICE_ID_LOGITECH_G29_WHEEL:
-			case USB_DEVICE_ID_LOGITECH_G923_WHEEL:
-				offset = 6;
-				break;
-			default:
-				return 0;
+	coeffs->level = level;
+	level_sign = level < 0 ? -1 : 1;
+
+	/* The device can loop a square wave by itself in fixed loop mode
+	 * when the half period is close enough to a number of loops */
+	if (effect->type == FF_PERIODIC && effect->u.periodic.waveform == FF_SQUARE
+			&& effect->u.periodic.phase == 0 && !attack_length && !fade_length) {
+		loops = DIV_ROUND_CLOSEST(effect->u.periodic.period, 2 * LG4FF_FIXED_LOOP_MS);
+		if (loops >= 1 && loops <= 255
+				&& abs((int)loops * 2 * LG4FF_FIXED_LOOP_MS - effect->u.periodic.period) * 20 <= effect->u.periodic.period) {
+			coeffs->native_loops = loops;
 		}
-
-		/* Compute a combined axis when wheel does not supply it */
-		rd[offset] = (0xFF + rd[offset] - rd[offset+2]) >> 1;
-		rd[offset+2] = 0x7F;
-		return 1;
 	}
 
-	return 0;
+	if (effect->type == FF_RAMP) {
+		/* The ramp attack runs from the start level towards the
+		 * attack level and the fade away from the end level */
+		coeffs->attack_level = level;
+		if (attack_length) {
+			coeffs->attack_slope = div_s64((s64)(level_sign * envelope->attack_level - level) << 32, attack_length);
+		}
+		end_level = effect->u.ramp.end_level;
+		coeffs->fade_level = end_level;
+		if (fade_length) {
+			coeffs->fade_slope = div_s64((s64)((end_level < 0 ? -1 : 1) * envelope->fade_level - end_level) << 32, fade_length);
+		}
+		duration = (long)coeffs->length - (long)attack_length - (long)fade_length;
+		if (coeffs->length && duration > 0) {
+			coeffs->slope = div_s64((s64)(end_level - level) << 32, duration);
+		}
+	} else {
+		coeffs->attack_level = level_sign * envelope->attack_level;
+		if (attack_length) {
+			coeffs->attack_slope = div_s64((s64)(level - coeffs->attack_level) << 32, attack_length);
+		}
+		coeffs->fade_level = level;
+		if (fade_length) {
+			coeffs->fade_slope = div_s64((s64)(level - level_sign * envelope->fade_level) << 32, fade_length);
+		}
+	}
 }
 
-static void lg4ff_init_wheel_data(struct lg4ff_wheel_data * const wdata, const struct lg4ff_wheel *wheel,
-				  const struct lg4ff_multimode_wheel *mmode_wheel,
-				  const u16 real_product_id)
+/* Pick up the last uploaded parameters. Called with timer_lock held, it never
+ * waits for an upload in progress, the new parameters will be fetched on the
+ * next tick instead. Returns whether new parameters were fetched. */
+static __always_inline int lg4ff_fetch_effect(struct lg4ff_effect_state *state, struct lg4ff_effect_data *data)
 {
-	u32 alternate_modes = 0;
-	const char *real_tag = NULL;
-	const char *real_name = NULL;
+	struct ff_effect effect;
+	struct lg4ff_effect_coeffs coeffs;
+	unsigned long updated_at;
+	unsigned int seq;
 
-	if (mmode_wheel) {
-		alternate_modes = mmode_wheel->alternate_modes;
-		real_tag = mmode_wheel->real_tag;
-		real_name = mmode_wheel->real_name;
+	seq = raw_read_seqcount(&data->seq);
+	if (seq == data->fetched_seq || (seq & 1)) {
+		return 0;
 	}
 
-	{
-		struct lg4ff_wheel_data t_wdata =  { .product_id = wheel->product_id,
-						     .real_product_id = real_product_id,
-						     .combine = 0,
-						     .min_range = wheel->min_range,
-						     .max_range = wheel->max_range,
-						     .set_range = wheel->set_range,
-						     .alternate_modes = alternate_modes,
-						     .real_tag = real_tag,
-						     .real_name = real_name,
-						     .capabilities = wheel->capabilities };
+	effect = data->pending;
+	coeffs = data->pending_coeffs;
+	updated_at = data->pending_at;
 
-		memcpy(wdata, &t_wdata, sizeof(t_wdata));
+	if (read_seqcount_retry(&data->seq, seq)) {
+		return 0;
 	}
+
+	data->effect = effect;
+	data->fetched_seq = seq;
+	data->fetched_at = updated_at;
+	state->coeffs = coeffs;
+
+	if (test_bit(FF_EFFECT_STARTED, &state->flags)) {
+		__set_bit(FF_EFFECT_UPDATING, &state->flags);
+		state->updated_at = updated_at;
+	}
+
+	return 1;
 }
 
-/* Sends default autocentering command compatible with
- * all wheels except Formula Force EX */
-static void lg4ff_set_autocenter_default(struct input_dev *dev, u16 magnitude)
+static __always_inline void lg4ff_update_state(struct lg4ff_effect_state *state, const unsigned long now)
 {
-	struct hid_device *hid = input_get_drvdata(dev);
-	u8 cmd[7];
-	u32 expand_a, expand_b;
-	struct lg4ff_device_entry *entry;
+	struct ff_effect *effect = state->effect;
+	struct lg4ff_effect_coeffs *coeffs = &state->coeffs;
+	unsigned long phase_time;
 
-	entry = lg4ff_get_device_entry(hid);
-	if (entry == NULL) {
-		return;
+	if (!__test_and_set_bit(FF_EFFECT_ALLSET, &state->flags)) {
+		state->play_at = state->start_at + coeffs->delay;
+		if (!test_bit(FF_EFFECT_UPDATING, &state->flags)) {
+			state->updated_at = state->play_at;
+		}
+		if (effect->type == FF_PERIODIC) {
+			state->phase_adj = coeffs->phase_adj;
+		}
+		if (coeffs->length) {
+			state->stop_at = state->play_at + coeffs->length;
+		}
 	}
 
-	entry->wdata.autocenter = magnitude;
+	if (__test_and_clear_bit(FF_EFFECT_UPDATING, &state->flags)) {
+		__clear_bit(FF_EFFECT_PLAYING, &state->flags);
+		state->play_at = state->updated_at + coeffs->delay;
+		if (coeffs->length) {
+			state->stop_at = state->updated_at + coeffs->length;
+		}
+		if (effect->type == FF_PERIODIC) {
+			state->phase_adj = state->phase;
+		}
+	}
 
-	/* De-activate Auto-Center */
-	if (magnitude == 0) {
-		cmd[0] = 0xf5;
-		cmd[1] = 0x00;
-		cmd[2] = 0x00;
-		cmd[3] = 0x00;
-		cmd[4] = 0x00;
-		cmd[5] = 0x00;
-		cmd[6] = 0x00;
-		lg4ff_send_cmd(entry, cmd);
-		return;
+	if (!test_bit(FF_EFFECT_PLAYING, &state->flags) && time_after_eq(now,
+				state->play_at) && (coeffs->length == 0 ||
+					time_before(now, state->stop_at))) {
+		__set_bit(FF_EFFECT_PLAYING, &state->flags);
 	}
 
-	if (magnitude <= 0xaaaa) {
-		expand_a = 0x0c * magnitude;
-		expand_b = 0x80 * magnitude;
+	if (test_bit(FF_EFFECT_PLAYING, &state->flags)) {
+		state->time_playing = time_diff(now, state->play_at);
+		if (effect->type == FF_PERIODIC) {
+			phase_time = time_diff(now, state->updated_at);
+			state->phase = (u32)(((u64)phase_time * coeffs->phase_rate) >> 16) + state->phase_adj;
+		}
+	}
+}
+
+static void lg4ff_set_timer_period(struct lg4ff_device_entry *entry, unsigned int period)
+{
+	struct lg4ff_rate_control *rate = &entry->rate;
+
+	period = clamp_t(unsigned int, period, LG4FF_MIN_TIMER_PERIOD_US, LG4FF_MAX_TIMER_PERIOD * USEC_PER_MSEC);
+	rate->min_period = period;
+	rate->max_period = LG4FF_MAX_TIMER_PERIOD * USEC_PER_MSEC;
+	if (entry->timer_mode == 0 || entry->timer_mode == 2 || rate->period < period) {
+		rate->period = period;
+	}
+}
+
+static void lg4ff_init_rate(struct lg4ff_device_entry *entry)
+{
+	memset(&entry->rate, 0, sizeof(entry->rate));
+	lg4ff_set_timer_period(entry, max(timer_msecs, 1) * USEC_PER_MSEC);
+}
+
+/* Track how long the queued commands take to complete */
+static __always_inline void lg4ff_rate_sample(struct lg4ff_rate_control *rate, unsigned int depth, unsigned long now, int exact)
+{
+	unsigned long drain_time;
+
+	rate->ticks++;
+	rate->depth = depth;
+	rate->busy = depth > 0;
+	if (depth > rate->max_depth) {
+		rate->max_depth = depth;
+	}
+	if (rate->busy) {
+		rate->busy_ticks++;
+	} else if (rate->draining) {
+		rate->draining = 0;
+		drain_time = time_diff(now, rate->sent_at);
+		rate->drain_time = rate->drain_time ? (rate->drain_time * 7 + drain_time) / 8 : drain_time;
+		rate->drain_exact = exact;
+	}
+}
+
+/* Adjust the timer period after a tick. In adaptive mode the period backs
+ * off quickly while the device can't keep up and slowly recovers after a few
+ * ticks have gone through without commands stacking up. */
+static __always_inline void lg4ff_rate_update(struct lg4ff_device_entry *entry, int overruns)
+{
+	struct lg4ff_rate_control *rate = &entry->rate;
+	unsigned int period = rate->period;
+	unsigned int floor;
+
+	if (overruns > 0) {
+		rate->overruns += overruns;
+	}
+
+	switch (entry->timer_mode) {
+		case 0:
+		case 2:
+			return;
+		case 1:
+			if (rate->busy && period < rate->max_period) {
+				period = min(period * 2, rate->max_period);
+				hid_info(entry->hid, "Commands stacking up, increasing timer period to %u us.", period);
+			}
+			break;
+		default:
+			/* A burst can't go out faster than the device takes
+			 * to complete it. Drains seen only at the next tick
+			 * just measure the period itself. */
+			floor = rate->drain_exact ? clamp(rate->drain_time, rate->min_period, rate->max_period)
+				: rate->min_period;
+			if (rate->busy || overruns > 0) {
+				rate->idle_ticks = 0;
+				if (period < rate->max_period) {
+					period = max(min(period + period / 4 + 1, rate->max_period), floor);
+					rate->backoffs++;
+				}
+			} else if (++rate->idle_ticks >= LG4FF_RATE_RECOVERY_TICKS) {
+				rate->idle_ticks = 0;
+				if (period > floor) {
+					period = max(period - period / 16 - 1, floor);
+					rate->recoveries++;
+				}
+			}
+	}
+
+	rate->period = period;
+}
+
+#ifdef CONFIG_LEDS_CLASS
+static __always_inline u8 lg4ff_leds_meter_state(int level)
+{
+	if (level < 2458) { // < 7.5%
+		return 0;
+	} else if (level < 8192) { // < 25%
+		return 1;
+	} else if (level < 16384) { // < 50%
+		return 3;
+	} else if (level < 24576) { // < 75%
+		return 7;
+	} else if (level < 29491) { // < 90%
+		return 15;
+	} else if (level <= 32768) { // <= 100%
+		return 31;
+	} else if (level < 36045) { // < 110%
+		return 30;
+	} else if (level < 40960) { // < 125%
+		return 28;
+	} else if (level < 49152) { // < 150%
+		return 24;
+	}
+	return 16;
+}
+
+/* The meter shows the peak level in each refresh period, it's cleared at once
+ * when the last effect stops */
+static __always_inline void lg4ff_update_leds_meter(struct lg4ff_device_entry *entry, int ffb_level, unsigned long now)
+{
+	struct lg4ff_leds_meter *meter = &entry->leds_meter;
+	u8 state;
+
+	if (ffb_level > meter->level) {
+		meter->level = ffb_level;
+	}
+
+	if (entry->effects_used == 0) {
+		meter->level = 0;
+	} else if (time_before(now, meter->refresh_at)) {
+		return;
+	}
+
+	meter->refresh_at = now + MS2US(LG4FF_LEDS_METER_PERIOD);
+	state = lg4ff_leds_meter_state(meter->level);
+	meter->level = 0;
+
+	if (state != meter->state) {
+		if (!meter->is_updated) {
+			meter->due_at = now + MS2US(LG4FF_LEDS_METER_PERIOD);
+		}
+		meter->state = state;
+		meter->is_updated = 1;
+	}
+}
+
+/* Lowest priority, sent when no slot updates went out in the tick, or once
+ * it has waited a whole refresh period so that a streamed force doesn't keep
+ * it back forever */
+static __always_inline void lg4ff_send_leds_meter(struct lg4ff_device_entry *entry, int sent, unsigned long now)
+{
+	struct lg4ff_leds_meter *meter = &entry->leds_meter;
+
+	if (!meter->is_updated) {
+		return;
+	}
+
+	if ((!sent && (entry->timer_mode == 0 || !entry->rate.busy)) || time_after_eq(now, meter->due_at)) {
+		meter->is_updated = 0;
+		lg4ff_set_leds(entry->hid, meter->state);
+	}
+}
+#endif
+
+/* Non-spinning read, the last good sample is kept when racing with an input
+ * report */
+static __always_inline void lg4ff_read_motion(struct lg4ff_device_entry *entry, const unsigned long now)
+{
+	struct lg4ff_motion *motion = &entry->motion;
+	struct lg4ff_motion_sample sample;
+	unsigned int seq;
+
+	seq = raw_read_seqcount(&motion->seq);
+	if (!(seq & 1)) {
+		sample = motion->sample;
+		if (!read_seqcount_retry(&motion->seq, seq)) {
+			entry->motion_sample = sample;
+		}
+	}
+
+	/* No input for a while, consider the wheel still */
+	if (time_diff(now, entry->motion_sample.updated_at) > LG4FF_MOTION_TIMEOUT) {
+		entry->motion_sample.delta = 0;
+		entry->motion_sample.delta2 = 0;
+	}
+}
+
+/* Spread a new constant force level over the time the application takes
+ * between updates so that it doesn't arrive as a single step */
+static __always_inline int lg4ff_smooth_level(struct lg4ff_device_entry *entry, int target)
+{
+	struct lg4ff_smoothing *smooth = &entry->smooth;
+	unsigned int ticks;
+
+	if (target != smooth->target) {
+		smooth->target = target;
+		ticks = smooth->interval / entry->rate.period;
+		smooth->step = 0;
+		if (ticks > 1) {
+			smooth->step = ((target << 8) - smooth->level) / (int)ticks;
+		}
+		if (!smooth->step) {
+			smooth->level = target << 8;
+		}
+	}
+
+	if (smooth->step) {
+		smooth->level += smooth->step;
+		if ((smooth->step > 0 && smooth->level >= target << 8)
+				|| (smooth->step < 0 && smooth->level <= target << 8)) {
+			smooth->level = target << 8;
+			smooth->step = 0;
+		}
+	}
+
+	return smooth->level >> 8;
+}
+
+/* Start from rest, the last level sent was 0 */
+static __always_inline void lg4ff_reset_smoothing(struct lg4ff_device_entry *entry)
+{
+	struct lg4ff_smoothing *smooth = &entry->smooth;
+
+	smooth->target = 0;
+	smooth->level = 0;
+	smooth->step = 0;
+	smooth->residual = 0;
+}
+
+/* Error diffusion down to the 8 bits sent to the device, the level returned
+ * translates exactly and the error is carried to the next tick */
+static __always_inline int lg4ff_dither_level(struct lg4ff_device_entry *entry, int level)
+{
+	struct lg4ff_smoothing *smooth = &entry->smooth;
+	int value = clamp(level, -0x8000, 0x7fff) + 0x8000 + smooth->residual;
+	int quantized = min(value & ~0xff, 0xff00);
+
+	smooth->residual = clamp(value - quantized, 0, 0xff);
+
+	return quantized - 0x8000;
+}
+
+/* Called with timer_lock held */
+static __always_inline void lg4ff_release_slot(struct lg4ff_device_entry *entry, struct lg4ff_effect_state *state)
+{
+	struct lg4ff_slot *slot;
+
+	if (!state->slot) {
+		return;
+	}
+
+	slot = &entry->slots[state->slot];
+	if (!--slot->users) {
+		slot->effect_type = 0;
+	}
+	state->slot = 0;
+}
+
+static __always_inline void lg4ff_hist_add(struct lg4ff_histogram *hist, unsigned long value)
+{
+	hist->buckets[min(fls_long(value), LG4FF_HIST_BUCKETS - 1)]++;
+	hist->count++;
+	hist->sum += value;
+	if (value > hist->max) {
+		hist->max = value;
+	}
+}
+
+/* Levels for a square wave played by the device itself in slot 0 */
+static __always_inline void lg4ff_native_square(struct lg4ff_effect_state *state, struct lg4ff_effect_parameters *parameters)
+{
+	int offset = state->effect->u.periodic.offset;
+
+	parameters->level = lg4ff_scale_direction(state, offset + state->coeffs.level);
+	parameters->low_level = lg4ff_scale_direction(state, offset - state->coeffs.level);
+	parameters->loops = state->coeffs.native_loops;
+}
+
+static __always_inline int lg4ff_scale_value(int value, u32 factor)
+{
+	return ((s64)value * factor) >> LG4FF_SCALE_SHIFT;
+}
+
+static __always_inline int lg4ff_scale_kind(int effect_type)
+{
+	switch (effect_type) {
+		case FF_SPRING:
+			return LG4FF_SCALE_SPRING;
+		case FF_DAMPER:
+			return LG4FF_SCALE_DAMPER;
+		case FF_FRICTION:
+			return LG4FF_SCALE_FRICTION;
+		default:
+			return LG4FF_SCALE_FORCE;
+	}
+}
+
+/* Mix the active effects into the slot parameters. Must be called with
+ * timer_lock held. Returns the total force level for the leds meter. */
+static __always_inline int lg4ff_mix_effects(struct lg4ff_device_entry *entry, struct lg4ff_effect_parameters *parameters, const unsigned long now)
+{
+	struct lg4ff_effect_state *state;
+	struct lg4ff_effect_state *native = NULL;
+	const struct lg4ff_scale *scale = &entry->scale;
+	unsigned int clip;
+	int effect_id;
+	int kind;
+	int i;
+	int ffb_level;
+	int constant_level = 0;
+	int forces = 0;
+
+	memset(parameters, 0, 4 * sizeof(*parameters));
+
+	lg4ff_read_motion(entry, now);
+
+	for_each_set_bit(effect_id, entry->active_effects, LG4FF_MAX_EFFECTS) {
+
+		state = &entry->states[effect_id];
+
+		if (lg4ff_fetch_effect(state, &entry->effects[effect_id]) && !entry->stats.upload_at) {
+			entry->stats.upload_at = entry->effects[effect_id].fetched_at;
+		}
+
+		if (test_bit(FF_EFFECT_ALLSET, &state->flags)) {
+			if (state->effect->replay.length && time_after_eq(now, state->stop_at)) {
+				STOP_EFFECT(state);
+				if (!--state->count) {
+					__clear_bit(effect_id, entry->active_effects);
+					entry->effects_used--;
+					lg4ff_release_slot(entry, state);
+					continue;
+				}
+				__set_bit(FF_EFFECT_STARTED, &state->flags);
+				state->start_at = state->stop_at;
+			}
+		}
+
+		lg4ff_update_state(state, now);
+
+		if (!test_bit(FF_EFFECT_PLAYING, &state->flags)) {
+			continue;
+		}
+
+		switch (state->effect->type) {
+			case FF_CONSTANT:
+				constant_level += lg4ff_calculate_constant(state);
+				forces++;
+				break;
+			case FF_RAMP:
+				parameters[0].level += lg4ff_calculate_ramp(state);
+				forces++;
+				break;
+			case FF_PERIODIC:
+				if (entry->hw_periodic && state->coeffs.native_loops) {
+					native = state;
+				}
+				parameters[0].level += lg4ff_calculate_periodic(state);
+				forces++;
+				break;
+			case FF_SPRING:
+				if (state->slot != 0) {
+					lg4ff_calculate_spring(state, &parameters[state->slot]);
+				}
+				break;
+			case FF_DAMPER:
+			case FF_FRICTION:
+				if (state->slot != 0) {
+					lg4ff_calculate_resistance(state, &parameters[state->slot]);
+				}
+				break;
+			case FF_INERTIA:
+				parameters[0].level += lg4ff_calculate_inertia(state, &entry->motion_sample, entry->scale.inertia);
+				forces++;
+				break;
+		}
+	}
+
+	if (entry->smoothing) {
+		constant_level = lg4ff_smooth_level(entry, constant_level);
+	}
+	parameters[0].level += constant_level;
+
+	/* A square wave playing alone is left to the device, the slot
+	 * command only changes when the wave does */
+	if (native && forces == 1) {
+		entry->slots[0].effect_type = FF_PERIODIC;
+		lg4ff_native_square(native, &parameters[0]);
+		parameters[0].level = lg4ff_scale_value(parameters[0].level, scale->gain);
+		parameters[0].low_level = lg4ff_scale_value(parameters[0].low_level, scale->gain);
+		ffb_level = max(abs(parameters[0].level), abs(parameters[0].low_level));
 	} else {
-		expand_a = (0x0c * 0xaaaa) + 0x06 * (magnitude - 0xaaaa);
-		expand_b = (0x80 * 0xaaaa) + 0xff * (magnitude - 0xaaaa);
+		entry->slots[0].effect_type = FF_CONSTANT;
+		parameters[0].level = lg4ff_scale_value(parameters[0].level, scale->gain);
+		ffb_level = abs(parameters[0].level);
+		if (entry->dithering) {
+			parameters[0].level = lg4ff_dither_level(entry, parameters[0].level);
+		}
+	}
+	for (i = 1; i < 4; i++) {
+		if (entry->slots[i].effect_type == FF_SPRING) {
+			lg4ff_merge_springs(&parameters[i]);
+		}
+		parameters[i].k1 = lg4ff_scale_value(parameters[i].k1, scale->gain);
+		parameters[i].k2 = lg4ff_scale_value(parameters[i].k2, scale->gain);
+		kind = lg4ff_scale_kind(entry->slots[i].effect_type);
+		clip = parameters[i].clip;
+		parameters[i].clip = ((u64)clip * scale->clip[kind]) >> LG4FF_SCALE_SHIFT;
+		ffb_level += ((u64)clip * scale->meter[kind]) >> LG4FF_SCALE_SHIFT;
+	}
+
+	return ffb_level;
+}
+
+/* Returns the number of slot commands sent */
+static __always_inline int lg4ff_timer(struct lg4ff_device_entry *entry)
+{
+	struct lg4ff_effect_parameters parameters[4];
+	unsigned long now = lg4ff_now();
+	unsigned long drained_at = now;
+	unsigned long completed_at = READ_ONCE(entry->output.completed_at);
+	unsigned long flags;
+	unsigned int depth = lg4ff_output_depth(entry);
+	int exact = 0;
+	int i;
+	int ffb_level;
+	int sent = 0;
+	int draining = entry->rate.draining;
+
+	/* Use the completion time of our own reports when the last command
+	 * went through them, it's closer to the wire time than the tick */
+	if (draining && !depth && time_after(completed_at, entry->rate.sent_at)
+			&& time_before_eq(completed_at, now)) {
+		drained_at = completed_at;
+		exact = 1;
+	}
+
+	lg4ff_rate_sample(&entry->rate, depth, drained_at, exact);
+
+	if (draining && !entry->rate.draining) {
+		trace_lg4ff_drain(entry->hid, time_diff(drained_at, entry->rate.sent_at));
+		if (entry->stats.queued_at) {
+			lg4ff_hist_add(&entry->stats.latency, time_diff(drained_at, entry->stats.queued_at));
+			entry->stats.queued_at = 0;
+		}
+	}
+
+	if (entry->timer_mode == 1 && entry->rate.busy) {
+		entry->stats.held++;
+		lg4ff_hist_add(&entry->stats.skip_depth, depth);
+		return 0;
+	}
+
+	spin_lock_irqsave(&entry->timer_lock, flags);
+
+	ffb_level = lg4ff_mix_effects(entry, parameters, now);
+
+	if (ffb_level > entry->peak_ffb_level) {
+		entry->peak_ffb_level = ffb_level;
+	}
+	lg4ff_telemetry_add(entry, parameters, ffb_level, now);
+
+	for (i = 0; i < 4; i++) {
+		if (!lg4ff_update_slot(&entry->slots[i], &parameters[i]) && entry->slots[i].cmd_op != 3) {
+			entry->stats.suppressed++;
+		}
+	}
+
+	/* Hold the updates while previous commands are still queued, newer
+	 * values will replace them in the slots until there's room */
+	if (entry->timer_mode == 0 || !entry->rate.busy) {
+		sent = lg4ff_send_slots(entry);
+		if (sent && !entry->rate.draining) {
+			entry->rate.sent_at = now;
+			entry->rate.draining = 1;
+		}
+		entry->stats.sent += sent;
+		if (!entry->stats.queued_at) {
+			entry->stats.queued_at = sent ? entry->stats.upload_at : 0;
+		}
+		entry->stats.upload_at = 0;
+	} else {
+		entry->stats.held++;
+		lg4ff_hist_add(&entry->stats.skip_depth, depth);
+	}
+
+	spin_unlock_irqrestore(&entry->timer_lock, flags);
+
+	/* One setting per tick behind the slot commands */
+	if (!entry->rate.busy) {
+		lg4ff_send_controls(entry, 1);
+	}
+
+#ifdef CONFIG_LEDS_CLASS
+	if (entry->ffb_leds) {
+		lg4ff_update_leds_meter(entry, ffb_level, now);
+	}
+	lg4ff_send_leds_meter(entry, sent, now);
+#endif
+
+	return sent;
+}
+
+/* Commands held back while the output queue was busy, or a smoothed level
+ * still on its way to the target */
+static __always_inline int lg4ff_output_pending(struct lg4ff_device_entry *entry)
+{
+	int i;
+
+	if (entry->smoothing && entry->smooth.step) {
+		return 1;
+	}
+
+	for (i = 0; i < 4; i++) {
+		if (entry->slots[i].is_updated) {
+			return 1;
+		}
+	}
+#ifdef CONFIG_LEDS_CLASS
+	if (entry->leds_meter.is_updated) {
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+/* First tick of the device in the shared grid at or after the given time */
+static ktime_t lg4ff_sched_next(struct lg4ff_device_entry *entry, ktime_t time)
+{
+	u32 period = entry->rate.period * NSEC_PER_USEC;
+	s64 delta = ktime_to_ns(ktime_sub(time, lg4ff_sched_epoch)) - period / LG4FF_SCHED_PHASES * entry->phase;
+	u32 rem;
+
+	if (delta < 0) {
+		return ktime_add_ns(time, -delta);
+	}
+	div_u64_rem(delta, period, &rem);
+
+	return rem ? ktime_add_ns(time, period - rem) : time;
+}
+
+/* Move the expiry one period forward, onto the grid when staggered. Returns
+ * the number of periods forwarded. */
+static int lg4ff_forward_timer(struct lg4ff_device_entry *entry)
+{
+	int overruns = hrtimer_forward_now(&entry->hrtimer, us_to_ktime(entry->rate.period));
+
+	if (entry->phase >= 0) {
+		hrtimer_set_expires(&entry->hrtimer, lg4ff_sched_next(entry, hrtimer_get_expires(&entry->hrtimer)));
+	}
+
+	return overruns;
+}
+
+/* Run one tick and move the expiry forward. Returns whether the timer has
+ * to go on. */
+static int lg4ff_tick(struct lg4ff_device_entry *entry)
+{
+	ktime_t start = ktime_get();
+	long lateness = ktime_us_delta(start, hrtimer_get_expires(&entry->hrtimer));
+	unsigned long flags;
+	int overruns;
+	int sent;
+
+	lg4ff_hist_add(&entry->stats.jitter, max(lateness, 0L));
+
+	sent = lg4ff_timer(entry);
+
+	lg4ff_hist_add(&entry->stats.compute, ktime_to_ns(ktime_sub(ktime_get(), start)));
+	trace_lg4ff_tick(entry->hid, lateness, entry->rate.depth, sent);
+
+	if (entry->effects_used || lg4ff_output_pending(entry)) {
+		overruns = lg4ff_forward_timer(entry);
+		overruns--;
+		if (unlikely(profile && overruns > 0))
+			DEBUG("Overruns: %d", overruns);
+		spin_lock_irqsave(&entry->timer_lock, flags);
+		lg4ff_rate_update(entry, overruns);
+		spin_unlock_irqrestore(&entry->timer_lock, flags);
+		return 1;
+	} else {
+		if (unlikely(profile))
+			DEBUG("Stop timer.");
+		spin_lock_irqsave(&entry->timer_lock, flags);
+		lg4ff_reset_smoothing(entry);
+		spin_unlock_irqrestore(&entry->timer_lock, flags);
+		return 0;
+	}
+}
+
+static enum hrtimer_restart lg4ff_timer_hires(struct hrtimer *t)
+{
+	struct lg4ff_device_entry *entry = container_of(t, struct lg4ff_device_entry, hrtimer);
+
+	return lg4ff_tick(entry) ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+/* In thread context the timer only paces the ticks, the thread runs them
+ * and arms the timer again. */
+static enum hrtimer_restart lg4ff_timer_wake(struct hrtimer *t)
+{
+	struct lg4ff_device_entry *entry = container_of(t, struct lg4ff_device_entry, hrtimer);
+
+	WRITE_ONCE(entry->thread_due, 1);
+	wake_up_process(entry->thread);
+
+	return HRTIMER_NORESTART;
+}
+
+static int lg4ff_timer_thread(void *data)
+{
+	struct lg4ff_device_entry *entry = data;
+	unsigned long flags;
+	int restart;
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!READ_ONCE(entry->thread_due)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+		WRITE_ONCE(entry->thread_due, 0);
+
+		restart = lg4ff_tick(entry);
+
+		/* Decide under the lock so that a new effect either sees the
+		 * timer running or starts it again */
+		spin_lock_irqsave(&entry->timer_lock, flags);
+		if (!restart && (entry->effects_used || lg4ff_output_pending(entry))) {
+			lg4ff_forward_timer(entry);
+			restart = 1;
+		}
+		if (restart) {
+			hrtimer_start_expires(&entry->hrtimer, HRTIMER_MODE_ABS_HARD);
+		} else {
+			entry->thread_ticking = 0;
+		}
+		spin_unlock_irqrestore(&entry->timer_lock, flags);
+	}
+
+	return 0;
+}
+
+/* Must be called with timer_lock held */
+static void lg4ff_start_timer(struct lg4ff_device_entry *entry)
+{
+	ktime_t delay = us_to_ktime(entry->rate.period);
+	ktime_t now;
+
+	if (entry->phase >= 0) {
+		now = ktime_get();
+		delay = ktime_sub(lg4ff_sched_next(entry, now), now);
+	}
+	if (entry->thread) {
+		entry->thread_ticking = 1;
+	}
+	hrtimer_start(&entry->hrtimer, delay, entry->hrtimer_mode);
+}
+
+static void lg4ff_init_timer(struct lg4ff_device_entry *entry)
+{
+	struct hid_device *hid = entry->hid;
+	int context = timer_context;
+
+	if (context == 2) {
+		entry->thread = kthread_create(lg4ff_timer_thread, entry, "lg4ff/%u", hid->id);
+		if (IS_ERR(entry->thread)) {
+			hid_warn(hid, "Unable to create the timer thread, errno %ld\n", PTR_ERR(entry->thread));
+			entry->thread = NULL;
+			context = 0;
+		} else {
+			/* Keep it around for the timer callback until the timer is gone */
+			get_task_struct(entry->thread);
+			if (timer_cpu >= 0 && timer_cpu < nr_cpu_ids && cpu_online(timer_cpu)) {
+				kthread_bind(entry->thread, timer_cpu);
+			}
+			sched_set_fifo(entry->thread);
+			wake_up_process(entry->thread);
+		}
+	}
+
+	switch (context) {
+	case 1:
+		entry->hrtimer_mode = HRTIMER_MODE_REL_SOFT;
+		break;
+	case 2:
+		entry->hrtimer_mode = HRTIMER_MODE_REL_HARD;
+		break;
+	default:
+		entry->hrtimer_mode = HRTIMER_MODE_REL;
+	}
+
+	hrtimer_init(&entry->hrtimer, CLOCK_MONOTONIC, entry->hrtimer_mode);
+	entry->hrtimer.function = entry->thread ? lg4ff_timer_wake : lg4ff_timer_hires;
+}
+
+/* Join the shared tick grid and the budget of the hub */
+static void lg4ff_sched_add(struct lg4ff_device_entry *entry)
+{
+	struct usb_device *hub = hid_to_usb_dev(entry->hid)->parent;
+	struct lg4ff_bus_group *group = NULL;
+	int i;
+
+	entry->phase = -1;
+
+	mutex_lock(&lg4ff_sched_mutex);
+
+	for (i = 0; stagger && i < LG4FF_SCHED_PHASES; i++) {
+		if (!test_bit(lg4ff_sched_order[i], &lg4ff_sched_phases)) {
+			if (!lg4ff_sched_phases) {
+				lg4ff_sched_epoch = ktime_get();
+			}
+			entry->phase = lg4ff_sched_order[i];
+			__set_bit(entry->phase, &lg4ff_sched_phases);
+			break;
+		}
+	}
+
+	for (i = 0; bus_budget > 0 && i < LG4FF_BUS_GROUPS; i++) {
+		if (lg4ff_bus_groups[i].users && lg4ff_bus_groups[i].hub == hub) {
+			group = &lg4ff_bus_groups[i];
+			break;
+		}
+	}
+	for (i = 0; bus_budget > 0 && !group && i < LG4FF_BUS_GROUPS; i++) {
+		if (!lg4ff_bus_groups[i].users) {
+			group = &lg4ff_bus_groups[i];
+			spin_lock_init(&group->lock);
+			group->hub = hub;
+			group->budget = bus_budget;
+			group->tokens = (unsigned long)group->budget * LG4FF_BUS_WINDOW * USEC_PER_MSEC;
+			group->refill_at = lg4ff_now();
+		}
+	}
+	if (group) {
+		group->users++;
+		entry->bus_group = group;
+	}
+
+	mutex_unlock(&lg4ff_sched_mutex);
+
+	if (!group && bus_budget > 0) {
+		hid_warn(entry->hid, "Too many hubs, the commands of this wheel won't be budgeted\n");
+	}
+}
+
+/* Must be called with the timer stopped */
+static void lg4ff_sched_remove(struct lg4ff_device_entry *entry)
+{
+	mutex_lock(&lg4ff_sched_mutex);
+	if (entry->phase >= 0) {
+		__clear_bit(entry->phase, &lg4ff_sched_phases);
+		entry->phase = -1;
+	}
+	if (entry->bus_group) {
+		entry->bus_group->users--;
+		entry->bus_group = NULL;
+	}
+	mutex_unlock(&lg4ff_sched_mutex);
+}
+
+static void lg4ff_stop_timer(struct lg4ff_device_entry *entry)
+{
+	if (entry->thread) {
+		kthread_stop(entry->thread);
+	}
+	hrtimer_cancel(&entry->hrtimer);
+	if (entry->thread) {
+		put_task_struct(entry->thread);
+		entry->thread = NULL;
+	}
+}
+
+/* Send a new constant force level right away instead of waiting for the
+ * next tick. Only done while it's the only force for slot 0 and it has no
+ * envelope, the timer would compute the same level, and at most once per
+ * timer period. It's skipped while the timer is running. Smoothing and
+ * dithering keep it off, the level would jump ahead of the one they render. */
+static void lg4ff_fast_constant(struct lg4ff_device_entry *entry, int effect_id, unsigned long now)
+{
+	struct lg4ff_effect_state *state = &entry->states[effect_id];
+	struct lg4ff_effect_parameters parameters;
+	struct lg4ff_effect_coeffs *coeffs;
+	unsigned long flags;
+	int sent;
+	int i;
+
+	if (time_diff(now, entry->fast_sent_at) < entry->rate.period || lg4ff_output_depth(entry)) {
+		return;
+	}
+
+	if (!spin_trylock_irqsave(&entry->timer_lock, flags)) {
+		return;
+	}
+
+	/* The smoothed and dithered levels only come out of the tick */
+	if (entry->smoothing || entry->dithering) {
+		goto out;
+	}
+
+	if (!test_bit(effect_id, entry->active_effects) || !test_bit(FF_EFFECT_ALLSET, &state->flags)) {
+		goto out;
+	}
+
+	for_each_set_bit(i, entry->active_effects, LG4FF_MAX_EFFECTS) {
+		switch (entry->states[i].effect->type) {
+			case FF_CONSTANT:
+			case FF_RAMP:
+			case FF_PERIODIC:
+			case FF_INERTIA:
+				if (i != effect_id) {
+					goto out;
+				}
+		}
+	}
+
+	if (lg4ff_fetch_effect(state, &entry->effects[effect_id]) && !entry->stats.upload_at) {
+		entry->stats.upload_at = entry->effects[effect_id].fetched_at;
+	}
+
+	coeffs = &state->coeffs;
+	if (coeffs->attack_length || (coeffs->length && coeffs->fade_start < (long)coeffs->length)) {
+		goto out;
+	}
+
+	lg4ff_update_state(state, now);
+	if (!test_bit(FF_EFFECT_PLAYING, &state->flags)) {
+		goto out;
+	}
+
+	memset(&parameters, 0, sizeof(parameters));
+	parameters.level = lg4ff_scale_value(lg4ff_calculate_constant(state), entry->scale.gain);
+	entry->slots[0].effect_type = FF_CONSTANT;
+
+	if (lg4ff_update_slot(&entry->slots[0], &parameters)) {
+		sent = lg4ff_send_slots(entry);
+		if (sent && !entry->rate.draining) {
+			entry->rate.sent_at = now;
+			entry->rate.draining = 1;
+		}
+		entry->stats.sent += sent;
+		entry->stats.immediate++;
+		if (!entry->stats.queued_at) {
+			entry->stats.queued_at = entry->stats.upload_at;
+		}
+		entry->stats.upload_at = 0;
+		entry->fast_sent_at = now;
+	}
+
+out:
+	spin_unlock_irqrestore(&entry->timer_lock, flags);
+}
+
+/* Clear all the effects and leave every slot with a pending command */
+static void lg4ff_reset_slots(struct lg4ff_device_entry *entry)
+{
+	struct lg4ff_effect_parameters parameters;
+	int i;
+
+	memset(&entry->states, 0, sizeof(entry->states));
+	memset(&entry->effects, 0, sizeof(entry->effects));
+	memset(&entry->slots, 0, sizeof(entry->slots));
+	memset(&parameters, 0, sizeof(parameters));
+	bitmap_zero(entry->active_effects, LG4FF_MAX_EFFECTS);
+	entry->effects_used = 0;
+
+	for (i = 0; i < LG4FF_MAX_EFFECTS; i++) {
+		entry->states[i].effect = &entry->effects[i].effect;
+		seqcount_init(&entry->effects[i].seq);
+	}
+
+	entry->slots[0].effect_type = FF_CONSTANT;
+
+	for (i = 0; i < 4; i++) {
+		entry->slots[i].id = i;
+		lg4ff_update_slot(&entry->slots[i], &parameters);
+		entry->slots[i].is_updated = 1;
+	}
+}
+
+static void lg4ff_send_loop_mode(struct lg4ff_device_entry *entry)
+{
+	u8 cmd[8] = {0};
+
+	// Set/unset fixed loop mode
+	cmd[0] = 0x0d;
+	cmd[1] = fixed_loop ? 1 : 0;
+	lg4ff_send_cmd(entry, cmd);
+}
+
+static void lg4ff_init_slots(struct lg4ff_device_entry *entry)
+{
+	lg4ff_send_loop_mode(entry);
+	lg4ff_reset_slots(entry);
+	lg4ff_send_slots(entry);
+}
+
+/* Download every slot again after the device lost them, the effects go on
+ * from where they were. Must be called with timer_lock held. */
+static void lg4ff_resend_slots(struct lg4ff_device_entry *entry)
+{
+	struct lg4ff_slot *slot;
+	unsigned long now = lg4ff_now();
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		slot = &entry->slots[i];
+		if ((slot->current_cmd[0] & 0xf) == 0xc) {
+			slot->current_cmd[0] = (slot->current_cmd[0] & 0xf0) + 1;
+			slot->cmd_op = 1;
+		}
+		slot->is_updated = 1;
+		/* Skip the threshold */
+		slot->sent_at = now - entry->hysteresis_time;
+	}
+	lg4ff_send_slots(entry);
+}
+
+static void lg4ff_stop_effects(struct lg4ff_device_entry *entry)
+{
+	u8 cmd[7] = {0};
+
+	cmd[0] = 0xf3;
+	lg4ff_send_cmd(entry, cmd);
+}
+
+/* Uploads are serialized by the FF core, the timer only reads interval */
+static void lg4ff_upload_interval(struct lg4ff_device_entry *entry, unsigned long now)
+{
+	struct lg4ff_smoothing *smooth = &entry->smooth;
+	unsigned long interval = time_diff(now, smooth->upload_at);
+
+	smooth->upload_at = now;
+
+	if (interval > LG4FF_SMOOTH_MAX_INTERVAL) {
+		smooth->interval = 0;
+	} else if (smooth->interval == 0) {
+		smooth->interval = interval;
+	} else {
+		smooth->interval = (smooth->interval * 7 + interval) / 8;
+	}
+}
+
+/* Uploads are serialized by the FF core, publish the new parameters
+ * without taking timer_lock */
+static void lg4ff_publish_effect(struct lg4ff_device_entry *entry, struct ff_effect *effect, const unsigned long now)
+{
+	struct lg4ff_effect_data *data = &entry->effects[effect->id];
+	struct lg4ff_effect_coeffs coeffs;
+
+	lg4ff_precompute_effect(effect, &coeffs, entry->rate.period);
+
+	raw_write_seqcount_begin(&data->seq);
+	data->pending = *effect;
+	data->pending_coeffs = coeffs;
+	data->pending_at = now;
+	raw_write_seqcount_end(&data->seq);
+
+	if (effect->type == FF_CONSTANT) {
+		lg4ff_upload_interval(entry, now);
+	}
+}
+
+static int lg4ff_upload_effect(struct input_dev *dev, struct ff_effect *effect, struct ff_effect *old)
+{
+	struct hid_device *hid = input_get_drvdata(dev);
+	struct lg4ff_device_entry *entry;
+	struct lg4ff_effect_state *state;
+	unsigned long now = lg4ff_now();
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	if (effect->type == FF_PERIODIC && effect->u.periodic.period == 0) {
+		return -EINVAL;
+	}
+
+	state = &entry->states[effect->id];
+
+	if (test_bit(FF_EFFECT_STARTED, &state->flags) && effect->type != state->effect->type) {
+		return -EINVAL;
+	}
+
+	lg4ff_publish_effect(entry, effect, now);
+
+	trace_lg4ff_upload(hid, effect->id, effect->type);
+	lg4ff_capture_upload(entry, effect, now);
+
+	if (effect->type == FF_CONSTANT && entry->fast_constant) {
+		lg4ff_fast_constant(entry, effect->id, now);
+	}
+
+	return 0;
+}
+
+/* Start or stop an effect. Must be called with timer_lock held. Returns
+ * whether the effect has just become active. */
+static int lg4ff_play_state(struct lg4ff_device_entry *entry, int effect_id, int value, const unsigned long now)
+{
+	struct lg4ff_effect_state *state = &entry->states[effect_id];
+	int activated = 0;
+	int slot_type;
+	int i;
+
+	if (lg4ff_fetch_effect(state, &entry->effects[effect_id]) && !entry->stats.upload_at) {
+		entry->stats.upload_at = entry->effects[effect_id].fetched_at;
+	}
+
+	if (value > 0) {
+		if (test_bit(FF_EFFECT_STARTED, &state->flags)) {
+			STOP_EFFECT(state);
+		} else {
+			__set_bit(effect_id, entry->active_effects);
+			entry->effects_used++;
+			activated = 1;
+			if ((state->effect->type == FF_SPRING || state->effect->type == FF_DAMPER
+					|| state->effect->type == FF_FRICTION)
+					&& state->slot == 0) {
+				slot_type = state->effect->type;
+
+				/* Cast unsupported friction to "damper": this is what the Windows
+				* driver does.
+				* This is not physically plausible, but we are working with toy-strength
+				* wheels that won't let you feel more than "big value = wheel stuck" */
+				if (slot_type == FF_FRICTION && !(entry->wdata.capabilities & LG4FF_CAP_FRICTION)) {
+					slot_type = FF_DAMPER;
+				}
+
+				/* Share the slot already playing this type or find a
+				 * free one. There are no more types than slots so
+				 * one of them is always found. */
+				for (i = 1; i < 4 && entry->slots[i].effect_type != slot_type; i++);
+				if (i == 4) {
+					for (i = 1; i < 4 && entry->slots[i].effect_type != 0; i++);
+				}
+				if (i < 4) {
+					state->slot = i;
+					entry->slots[i].effect_type = slot_type;
+					entry->slots[i].users++;
+				}
+			}
+		}
+		__set_bit(FF_EFFECT_STARTED, &state->flags);
+		state->start_at = now;
+		state->count = value;
+	} else {
+		if (test_bit(FF_EFFECT_STARTED, &state->flags)) {
+			STOP_EFFECT(state);
+			__clear_bit(effect_id, entry->active_effects);
+			entry->effects_used--;
+			lg4ff_release_slot(entry, state);
+		}
+	}
+
+	return activated;
+}
+
+static int lg4ff_play_effect(struct input_dev *dev, int effect_id, int value)
+{
+	struct hid_device *hid = input_get_drvdata(dev);
+	struct lg4ff_device_entry *entry;
+	unsigned long now = lg4ff_now();
+	unsigned long flags;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	trace_lg4ff_play(hid, effect_id, value);
+	lg4ff_capture_play(entry, effect_id, value, now);
+
+	spin_lock_irqsave(&entry->timer_lock, flags);
+
+	if (lg4ff_play_state(entry, effect_id, value, now) && !lg4ff_timer_active(entry)) {
+		lg4ff_start_timer(entry);
+		if (unlikely(profile))
+			DEBUG("Start timer.");
+	}
+
+	spin_unlock_irqrestore(&entry->timer_lock, flags);
+
+	return 0;
+}
+
+/* Range the hardware reports the axis in for the selected range */
+static u16 lg4ff_hardware_range(struct lg4ff_device_entry *entry)
+{
+	u16 range = entry->wdata.range;
+
+	if (!entry->wdata.set_range) {
+		return entry->wdata.max_range;
+	}
+
+	/* The DFP only switches between 200 and 900 degrees */
+	if (entry->wdata.product_id == USB_DEVICE_ID_LOGITECH_DFP_WHEEL) {
+		return range > 200 ? 900 : 200;
+	}
+
+	return range;
+}
+
+/* Map a position in the [-65536, 65536] range through the deadzone and
+ * linearity settings, positions outside are kept linear so that the
+ * interpolation is exact on the clamped ends */
+static s64 lg4ff_curve_shape(s64 x, unsigned deadzone, unsigned linearity)
+{
+	s64 dz = div_s64((s64)deadzone << 16, 100);
+	s64 ax = abs(x);
+	s64 y;
+
+	if (ax <= dz) {
+		return 0;
+	}
+	y = div64_s64((ax - dz) << 16, (1 << 16) - dz);
+
+	/* Bend the response keeping the ends fixed, linearity under 100
+	 * makes the center more sensitive */
+	y += div_s64((100 - (s64)linearity) * y * ((1 << 16) - min_t(s64, y, 1 << 16)), 100) >> 16;
+
+	return x < 0 ? -y : y;
+}
+
+/* Build the axis curve in the spare buffer and switch to it, the input path
+ * only does a table lookup */
+static void lg4ff_update_curve(struct lg4ff_device_entry *entry)
+{
+	struct hid_device *hid = entry->hid;
+	struct hid_input *hidinput;
+	struct lg4ff_curve *curve;
+	u16 hw_range = lg4ff_hardware_range(entry);
+	u16 range = entry->wdata.range;
+	s64 span, half, center, x;
+	int min, max;
+	int k;
+
+	if (list_empty(&hid->inputs)) {
+		return;
+	}
+	hidinput = list_entry(hid->inputs.next, struct hid_input, list);
+	min = input_abs_get_min(hidinput->input, ABS_X);
+	max = input_abs_get_max(hidinput->input, ABS_X);
+
+	mutex_lock(&entry->curve_mutex);
+
+	if (max <= min || range == 0 || (hw_range == range && entry->deadzone == 0 && entry->linearity == 100)) {
+		WRITE_ONCE(entry->curve, NULL);
+		synchronize_rcu();
+		mutex_unlock(&entry->curve_mutex);
+		return;
+	}
+
+	curve = entry->curve == &entry->curves[0] ? &entry->curves[1] : &entry->curves[0];
+	span = (s64)max - min;
+	half = span / 2;
+	center = min + (span + 1) / 2;
+	curve->min = min;
+	curve->max = max;
+	curve->scale = div64_u64((u64)LG4FF_CURVE_POINTS << LG4FF_CURVE_SHIFT, span);
+
+	for (k = 0; k <= LG4FF_CURVE_POINTS; k++) {
+		/* Position relative to the center in 1/65536 of the half span */
+		x = div64_s64((span * k - (center - min) * LG4FF_CURVE_POINTS) * hw_range << 16,
+				(s64)LG4FF_CURVE_POINTS * range * half);
+		x = lg4ff_curve_shape(x, entry->deadzone, entry->linearity);
+		curve->points[k] = clamp_val(center + ((x * half) >> 16), S32_MIN, S32_MAX);
+	}
+
+	WRITE_ONCE(entry->curve, curve);
+	/* Input reports are handled with preemption disabled, wait for the
+	 * readers of the buffer that will be rebuilt next time */
+	synchronize_rcu();
+
+	mutex_unlock(&entry->curve_mutex);
+}
+
+static s32 lg4ff_apply_curve(const struct lg4ff_curve *curve, s32 value)
+{
+	u64 pos;
+	unsigned int i;
+	u32 frac;
+	s32 a, b;
+
+	value = clamp(value, curve->min, curve->max);
+	pos = (u64)(value - curve->min) * curve->scale;
+	i = min_t(u64, pos >> LG4FF_CURVE_SHIFT, LG4FF_CURVE_POINTS - 1);
+	frac = (pos - ((u64)i << LG4FF_CURVE_SHIFT)) >> (LG4FF_CURVE_SHIFT - 16);
+	a = curve->points[i];
+	b = curve->points[i + 1];
+	value = a + (s32)(((s64)(b - a) * frac) >> 16);
+
+	return clamp(value, curve->min, curve->max);
+}
+
+/* Called for every wheel position report, there's a single writer */
+static void lg4ff_update_motion(struct lg4ff_device_entry *entry, struct hid_field *field, s32 value)
+{
+	struct lg4ff_motion *motion = &entry->motion;
+	struct lg4ff_motion_sample sample = motion->sample;
+	int span = field->logical_maximum - field->logical_minimum;
+	unsigned long now = lg4ff_now();
+	unsigned long dt = time_diff(now, sample.updated_at);
+	int position;
+	int delta;
+
+	if (span <= 0 || dt == 0) {
+		return;
+	}
+
+	if (span != motion->span) {
+		motion->span = span;
+		motion->scale = div_u64(1ULL << 32, span);
+	}
+
+	position = (((s64)(value - field->logical_minimum) * motion->scale) >> 16) - 0x8000;
+
+	/* Only shifts here, this runs for every input report */
+	if (dt > LG4FF_MOTION_TIMEOUT) {
+		sample.delta = 0;
+		sample.delta2 = 0;
+	} else {
+		delta = sample.delta + ((((position - sample.position) << 8) - sample.delta) >> 2);
+		sample.delta2 += ((delta - sample.delta) - sample.delta2) >> 2;
+		sample.delta = delta;
+		if (sample.interval) {
+			sample.interval += ((long)dt - (long)sample.interval) >> 2;
+		} else {
+			sample.interval = dt;
+		}
+	}
+	sample.position = position;
+	sample.updated_at = now;
+
+	raw_write_seqcount_begin(&motion->seq);
+	motion->sample = sample;
+	raw_write_seqcount_end(&motion->seq);
+}
+
+int lg4ff_adjust_input_event(struct hid_device *hid, struct hid_field *field,
+			     struct hid_usage *usage, s32 value, struct lg_drv_data *drv_data)
+{
+	struct lg4ff_device_entry *entry = drv_data->device_props;
+	const struct lg4ff_curve *curve;
+
+	if (!entry) {
+		hid_err(hid, "Device properties not found");
+		return 0;
+	}
+
+	if (usage->code != ABS_X || usage->type != EV_ABS) {
+		return 0;
+	}
+
+	lg4ff_update_motion(entry, field, value);
+
+	curve = READ_ONCE(entry->curve);
+	if (curve) {
+		input_event(field->hidinput->input, usage->type, usage->code, lg4ff_apply_curve(curve, value));
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Resolve the pedals fixup once instead of on every report */
+static void lg4ff_set_combine(struct lg4ff_device_entry *entry, u16 combine)
+{
+	const struct lg4ff_pedals_fixup *pedals = NULL;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(lg4ff_pedals_fixups) && combine; i++) {
+		if (lg4ff_pedals_fixups[i].product_id == entry->wdata.product_id
+				&& lg4ff_pedals_fixups[i].combine == combine) {
+			pedals = &lg4ff_pedals_fixups[i];
+			break;
+		}
+	}
+
+	entry->wdata.combine = combine;
+	WRITE_ONCE(entry->pedals, pedals);
+}
+
+int lg4ff_raw_event(struct hid_device *hdev, struct hid_report *report,
+		u8 *rd, int size, struct lg_drv_data *drv_data)
+{
+	struct lg4ff_device_entry *entry = drv_data->device_props;
+	const struct lg4ff_pedals_fixup *pedals;
+
+	if (!entry)
+		return 0;
+
+	pedals = READ_ONCE(entry->pedals);
+	if (!pedals || size <= pedals->idle)
+		return 0;
+
+	/* adjust HID report present combined pedals data */
+	if (pedals->copy) {
+		rd[pedals->dst] = rd[pedals->src];
+	} else {
+		/* Compute a combined axis when wheel does not supply it */
+		rd[pedals->dst] = (0xFF + rd[pedals->dst] - rd[pedals->src]) >> 1;
+	}
+	rd[pedals->idle] = 0x7F;
+
+	return 1;
+}
+
+static void lg4ff_init_wheel_data(struct lg4ff_wheel_data * const wdata, const struct lg4ff_wheel *wheel,
+				  const struct lg4ff_multimode_wheel *mmode_wheel,
+				  const u16 real_product_id)
+{
+	u32 alternate_modes = 0;
+	const char *real_tag = NULL;
+	const char *real_name = NULL;
+
+	if (mmode_wheel) {
+		alternate_modes = mmode_wheel->alternate_modes;
+		real_tag = mmode_wheel->real_tag;
+		real_name = mmode_wheel->real_name;
+	}
+
+	{
+		struct lg4ff_wheel_data t_wdata =  { .product_id = wheel->product_id,
+						     .real_product_id = real_product_id,
+						     .combine = 0,
+						     .min_range = wheel->min_range,
+						     .max_range = wheel->max_range,
+						     .set_range = wheel->set_range,
+						     .alternate_modes = alternate_modes,
+						     .real_tag = real_tag,
+						     .real_name = real_name,
+						     .capabilities = wheel->capabilities };
+
+		memcpy(wdata, &t_wdata, sizeof(t_wdata));
+	}
+}
+
+/* Sends default autocentering command compatible with
+ * all wheels except Formula Force EX */
+static void lg4ff_set_autocenter_default(struct input_dev *dev, u16 magnitude)
+{
+	struct hid_device *hid = input_get_drvdata(dev);
+	u8 cmd[2][7];
+	u32 expand_a, expand_b;
+	struct lg4ff_device_entry *entry;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return;
+	}
+
+	entry->wdata.autocenter = magnitude;
+
+	/* De-activate Auto-Center */
+	if (magnitude == 0) {
+		cmd[0][0] = 0xf5;
+		cmd[0][1] = 0x00;
+		cmd[0][2] = 0x00;
+		cmd[0][3] = 0x00;
+		cmd[0][4] = 0x00;
+		cmd[0][5] = 0x00;
+		cmd[0][6] = 0x00;
+		lg4ff_queue_control(entry, LG4FF_CTRL_AUTOCENTER, cmd, 1);
+		return;
+	}
+
+	if (magnitude <= 0xaaaa) {
+		expand_a = 0x0c * magnitude;
+		expand_b = 0x80 * magnitude;
+	} else {
+		expand_a = (0x0c * 0xaaaa) + 0x06 * (magnitude - 0xaaaa);
+		expand_b = (0x80 * 0xaaaa) + 0xff * (magnitude - 0xaaaa);
+	}
+
+	/* Adjust for non-MOMO wheels */
+	switch (entry->wdata.product_id) {
+	case USB_DEVICE_ID_LOGITECH_MOMO_WHEEL:
+	case USB_DEVICE_ID_LOGITECH_MOMO_WHEEL2:
+		break;
+	default:
+		expand_a = expand_a >> 1;
+		break;
+	}
+
+	cmd[0][0] = 0xfe;
+	cmd[0][1] = 0x0d;
+	cmd[0][2] = expand_a / 0xaaaa;
+	cmd[0][3] = expand_a / 0xaaaa;
+	cmd[0][4] = expand_b / 0xaaaa;
+	cmd[0][5] = 0x00;
+	cmd[0][6] = 0x00;
+
+	/* Activate Auto-Center */
+	cmd[1][0] = 0x14;
+	cmd[1][1] = 0x00;
+	cmd[1][2] = 0x00;
+	cmd[1][3] = 0x00;
+	cmd[1][4] = 0x00;
+	cmd[1][5] = 0x00;
+	cmd[1][6] = 0x00;
+	lg4ff_queue_control(entry, LG4FF_CTRL_AUTOCENTER, cmd, 2);
+}
+
+/* Sends autocentering command compatible with Formula Force EX */
+static void lg4ff_set_autocenter_ffex(struct input_dev *dev, u16 magnitude)
+{
+	struct hid_device *hid = input_get_drvdata(dev);
+	struct lg4ff_device_entry *entry;
+	u8 cmd[1][7];
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return;
+	}
+
+	entry->wdata.autocenter = magnitude;
+
+	magnitude = magnitude * 90 / 65535;
+
+	cmd[0][0] = 0xfe;
+	cmd[0][1] = 0x03;
+	cmd[0][2] = magnitude >> 14;
+	cmd[0][3] = magnitude >> 14;
+	cmd[0][4] = magnitude;
+	cmd[0][5] = 0x00;
+	cmd[0][6] = 0x00;
+	lg4ff_queue_control(entry, LG4FF_CTRL_AUTOCENTER, cmd, 1);
+}
+
+/* Sends command to set range compatible with G25/G27/Driving Force GT */
+static void lg4ff_set_range_g25(struct hid_device *hid, u16 range)
+{
+	struct lg4ff_device_entry *entry;
+	struct lg_drv_data *drv_data;
+	u8 cmd[1][7];
+
+	drv_data = hid_get_drvdata(hid);
+	entry = drv_data->device_props;
+
+	dbg_hid("G25/G27/DFGT: setting range to %u\n", range);
+
+	cmd[0][0] = 0xf8;
+	cmd[0][1] = 0x81;
+	cmd[0][2] = range & 0x00ff;
+	cmd[0][3] = (range & 0xff00) >> 8;
+	cmd[0][4] = 0x00;
+	cmd[0][5] = 0x00;
+	cmd[0][6] = 0x00;
+	lg4ff_queue_control(entry, LG4FF_CTRL_RANGE, cmd, 1);
+}
+
+/* Sends commands to set range compatible with Driving Force Pro wheel */
+static void lg4ff_set_range_dfp(struct hid_device *hid, u16 range)
+{
+	struct lg4ff_device_entry *entry;
+	struct lg_drv_data *drv_data;
+	int start_left, start_right, full_range;
+	u8 cmd[2][7];
+
+	drv_data = hid_get_drvdata(hid);
+	entry = drv_data->device_props;
+
+	dbg_hid("Driving Force Pro: setting range to %u\n", range);
+
+	/* Prepare "coarse" limit command */
+	cmd[0][0] = 0xf8;
+	cmd[0][1] = 0x00;	/* Set later */
+	cmd[0][2] = 0x00;
+	cmd[0][3] = 0x00;
+	cmd[0][4] = 0x00;
+	cmd[0][5] = 0x00;
+	cmd[0][6] = 0x00;
+
+	if (range > 200) {
+		cmd[0][1] = 0x03;
+		full_range = 900;
+	} else {
+		cmd[0][1] = 0x02;
+		full_range = 200;
+	}
+
+	/* Prepare "fine" limit command */
+	cmd[1][0] = 0x81;
+	cmd[1][1] = 0x0b;
+	cmd[1][2] = 0x00;
+	cmd[1][3] = 0x00;
+	cmd[1][4] = 0x00;
+	cmd[1][5] = 0x00;
+	cmd[1][6] = 0x00;
+
+	if (range == 200 || range == 900) {	/* Do not apply any fine limit */
+		lg4ff_queue_control(entry, LG4FF_CTRL_RANGE, cmd, 2);
+		return;
+	}
+
+	/* Construct fine limit command */
+	start_left = (((full_range - range + 1) * 2047) / full_range);
+	start_right = 0xfff - start_left;
+
+	cmd[1][2] = start_left >> 4;
+	cmd[1][3] = start_right >> 4;
+	cmd[1][4] = 0xff;
+	cmd[1][5] = (start_right & 0xe) << 4 | (start_left & 0xe);
+	cmd[1][6] = 0xff;
+	lg4ff_queue_control(entry, LG4FF_CTRL_RANGE, cmd, 2);
+}
+
+/* The ticks only multiply and shift, the divisions are done here */
+static void lg4ff_build_scale(struct lg4ff_device_entry *entry)
+{
+	struct lg4ff_scale *scale = &entry->scale;
+	const unsigned levels[LG4FF_SCALE_KINDS] = {
+		[LG4FF_SCALE_FORCE] = 100,
+		[LG4FF_SCALE_SPRING] = entry->spring_level,
+		[LG4FF_SCALE_DAMPER] = entry->damper_level,
+		[LG4FF_SCALE_FRICTION] = entry->friction_level,
+	};
+	u64 gain = (u64)entry->wdata.master_gain * entry->wdata.gain;
+	int i;
+
+	scale->gain = div_u64((gain << LG4FF_SCALE_SHIFT) + 0xffffu * 0xffffu / 2, 0xffffu * 0xffffu);
+	for (i = 0; i < LG4FF_SCALE_KINDS; i++) {
+		scale->clip[i] = scale->gain * levels[i] / 100;
+		scale->meter[i] = scale->clip[i] * 0x7fff / 0xffff;
+	}
+	scale->inertia = (entry->inertia_level << LG4FF_SCALE_SHIFT) / 100;
+}
+
+static void lg4ff_update_scale(struct lg4ff_device_entry *entry)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&entry->timer_lock, flags);
+	lg4ff_build_scale(entry);
+	spin_unlock_irqrestore(&entry->timer_lock, flags);
+}
+
+static void lg4ff_set_gain(struct input_dev *dev, u16 gain)
+{
+	struct hid_device *hid = input_get_drvdata(dev);
+	struct lg4ff_device_entry *entry;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return;
+	}
+
+	entry->wdata.gain = gain;
+	lg4ff_update_scale(entry);
+}
+
+static const struct lg4ff_compat_mode_switch *lg4ff_get_mode_switch_command(const u16 real_product_id, const u16 target_product_id)
+{
+	switch (real_product_id) {
+	case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
+		switch (target_product_id) {
+		case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
+			return &lg4ff_mode_switch_ext01_dfp;
+		/* DFP can only be switched to its native mode */
+		default:
+			return NULL;
+		}
+		break;
+	case USB_DEVICE_ID_LOGITECH_G25_WHEEL:
+		switch (target_product_id) {
+		case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
+			return &lg4ff_mode_switch_ext01_dfp;
+		case USB_DEVICE_ID_LOGITECH_G25_WHEEL:
+			return &lg4ff_mode_switch_ext16_g25;
+		/* G25 can only be switched to DFP mode or its native mode */
+		default:
+			return NULL;
+		}
+		break;
+	case USB_DEVICE_ID_LOGITECH_G27_WHEEL:
+		switch (target_product_id) {
+		case USB_DEVICE_ID_LOGITECH_WHEEL:
+			return &lg4ff_mode_switch_ext09_dfex;
+		case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
+			return &lg4ff_mode_switch_ext09_dfp;
+		case USB_DEVICE_ID_LOGITECH_G25_WHEEL:
+			return &lg4ff_mode_switch_ext09_g25;
+		case USB_DEVICE_ID_LOGITECH_G27_WHEEL:
+			return &lg4ff_mode_switch_ext09_g27;
+		/* G27 can only be switched to DF-EX, DFP, G25 or its native mode */
+		default:
+			return NULL;
+		}
+		break;
+	case USB_DEVICE_ID_LOGITECH_G29_WHEEL:
+		switch (target_product_id) {
+		case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
+			return &lg4ff_mode_switch_ext09_dfp;
+		case USB_DEVICE_ID_LOGITECH_DFGT_WHEEL:
+			return &lg4ff_mode_switch_ext09_dfgt;
+		case USB_DEVICE_ID_LOGITECH_G25_WHEEL:
+			return &lg4ff_mode_switch_ext09_g25;
+		case USB_DEVICE_ID_LOGITECH_G27_WHEEL:
+			return &lg4ff_mode_switch_ext09_g27;
+		case USB_DEVICE_ID_LOGITECH_G29_WHEEL:
+			return &lg4ff_mode_switch_ext09_g29;
+		/* G29 can only be switched to DF-EX, DFP, DFGT, G25, G27 or its native mode */
+		default:
+			return NULL;
+		}
+		break;
+	case USB_DEVICE_ID_LOGITECH_G923_PS_WHEEL:
+		switch (target_product_id) {
+		case USB_DEVICE_ID_LOGITECH_G923_WHEEL:
+			return &lg4ff_mode_switch_30_g923;
+		/* We can only switch from PS mode to Classic. */
+		default:
+			return NULL;
+		}
+		break;
+	case USB_DEVICE_ID_LOGITECH_DFGT_WHEEL:
+		switch (target_product_id) {
+		case USB_DEVICE_ID_LOGITECH_WHEEL:
+			return &lg4ff_mode_switch_ext09_dfex;
+		case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
+			return &lg4ff_mode_switch_ext09_dfp;
+		case USB_DEVICE_ID_LOGITECH_DFGT_WHEEL:
+			return &lg4ff_mode_switch_ext09_dfgt;
+		/* DFGT can only be switched to DF-EX, DFP or its native mode */
+		default:
+			return NULL;
+		}
+		break;
+	/* No other wheels have multiple modes */
+	default:
+		return NULL;
+	}
+}
+
+static int lg4ff_switch_compatibility_mode(struct hid_device *hid, const struct lg4ff_compat_mode_switch *s)
+{
+	struct lg4ff_device_entry *entry;
+	u8 cmd[7];
+	u8 i;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < s->cmd_count; i++) {
+		u8 j;
+
+		for (j = 0; j < 7; j++)
+			cmd[j] = s->cmd[j + (7*i)];
+
+		lg4ff_send_cmd(entry, cmd);
+	}
+	hid_hw_wait(hid);
+	return 0;
+}
+
+/* For switching from PS mode we need to set report id to 0x30 */
+static int lg4ff_switch_from_ps_mode(struct hid_device *hid, const struct lg4ff_compat_mode_switch *s)
+{
+	struct lg4ff_device_entry *entry;
+	u8 cmd[7];
+	u8 i;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < s->cmd_count; i++) {
+		u8 j;
+
+		for (j = 0; j < 7; j++)
+			cmd[j] = s->cmd[j + (7*i)];
+
+		lg4ff_send_cmd_with_id(entry, cmd, 0x30);
+	}
+	hid_hw_wait(hid);
+	return 0;
+}
+
+static ssize_t lg4ff_alternate_modes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	ssize_t count = 0;
+	int i;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	if (!entry->wdata.real_name) {
+		hid_err(hid, "NULL pointer to string\n");
+		return 0;
+	}
+
+	for (i = 0; i < LG4FF_MODE_MAX_IDX; i++) {
+		if (entry->wdata.alternate_modes & BIT(i)) {
+			/* Print tag and full name */
+			count += scnprintf(buf + count, PAGE_SIZE - count, "%s: %s",
+					   lg4ff_alternate_modes[i].tag,
+					   !lg4ff_alternate_modes[i].product_id ? entry->wdata.real_name : lg4ff_alternate_modes[i].name);
+			if (count >= PAGE_SIZE - 1)
+				return count;
+
+			/* Mark the currently active mode with an asterisk */
+			if (lg4ff_alternate_modes[i].product_id == entry->wdata.product_id ||
+			    (lg4ff_alternate_modes[i].product_id == 0 && entry->wdata.product_id == entry->wdata.real_product_id))
+				count += scnprintf(buf + count, PAGE_SIZE - count, " *\n");
+			else
+				count += scnprintf(buf + count, PAGE_SIZE - count, "\n");
+
+			if (count >= PAGE_SIZE - 1)
+				return count;
+		}
+	}
+
+	return count;
+}
+
+static ssize_t lg4ff_alternate_modes_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	const struct lg4ff_compat_mode_switch *s;
+	u16 target_product_id = 0;
+	int i, ret;
+	char *lbuf;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	/* Allow \n at the end of the input parameter */
+	lbuf = kasprintf(GFP_KERNEL, "%s", buf);
+	if (!lbuf)
+		return -ENOMEM;
+
+	i = strlen(lbuf);
+
+	if (i == 0) {
+		kfree(lbuf);
+		return -EINVAL;
+	}
+
+	if (lbuf[i-1] == '\n') {
+		if (i == 1) {
+			kfree(lbuf);
+			return -EINVAL;
+		}
+		lbuf[i-1] = '\0';
+	}
+
+	for (i = 0; i < LG4FF_MODE_MAX_IDX; i++) {
+		const u16 mode_product_id = lg4ff_alternate_modes[i].product_id;
+		const char *tag = lg4ff_alternate_modes[i].tag;
+
+		if (entry->wdata.alternate_modes & BIT(i)) {
+			if (!strcmp(tag, lbuf)) {
+				if (!mode_product_id)
+					target_product_id = entry->wdata.real_product_id;
+				else
+					target_product_id = mode_product_id;
+				break;
+			}
+		}
+	}
+
+	if (i == LG4FF_MODE_MAX_IDX) {
+		hid_info(hid, "Requested mode \"%s\" is not supported by the device\n", lbuf);
+		kfree(lbuf);
+		return -EINVAL;
+	}
+	kfree(lbuf); /* Not needed anymore */
+
+	if (target_product_id == entry->wdata.product_id) /* Nothing to do */
+		return count;
+
+	/* Automatic switching has to be disabled for the switch to DF-EX mode to work correctly */
+	if (target_product_id == USB_DEVICE_ID_LOGITECH_WHEEL && !lg4ff_no_autoswitch) {
+		hid_info(hid, "\"%s\" cannot be switched to \"DF-EX\" mode. Load the \"hid_logitech\" module with \"lg4ff_no_autoswitch=1\" parameter set and try again\n",
+			 entry->wdata.real_name);
+		return -EINVAL;
+	}
+
+	/* Take care of hardware limitations */
+	if ((entry->wdata.real_product_id == USB_DEVICE_ID_LOGITECH_DFP_WHEEL || entry->wdata.real_product_id == USB_DEVICE_ID_LOGITECH_G25_WHEEL) &&
+	    entry->wdata.product_id > target_product_id) {
+		hid_info(hid, "\"%s\" cannot be switched back into \"%s\" mode\n", entry->wdata.real_name, lg4ff_alternate_modes[i].name);
+		return -EINVAL;
+	}
+
+	s = lg4ff_get_mode_switch_command(entry->wdata.real_product_id, target_product_id);
+	if (!s) {
+		hid_err(hid, "Invalid target product ID %X\n", target_product_id);
+		return -EINVAL;
+	}
+
+	ret = lg4ff_switch_compatibility_mode(hid, s);
+	return (ret == 0 ? count : ret);
+}
+static DEVICE_ATTR(alternate_modes, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_alternate_modes_show, lg4ff_alternate_modes_store);
+
+static ssize_t lg4ff_combine_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	size_t count;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->wdata.combine);
+	return count;
+}
+
+static ssize_t lg4ff_combine_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	u16 combine = simple_strtoul(buf, NULL, 10);
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	if (combine > 2)
+		combine = 2;
+
+	lg4ff_set_combine(entry, combine);
+	return count;
+}
+static DEVICE_ATTR(combine_pedals, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_combine_show, lg4ff_combine_store);
+
+/* Export the currently set range of the wheel */
+static ssize_t lg4ff_range_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	size_t count;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->wdata.range);
+	return count;
+}
+
+/* Set range to user specified value, call appropriate function
+ * according to the type of the wheel */
+static ssize_t lg4ff_range_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	u16 range = simple_strtoul(buf, NULL, 10);
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	if (range == 0)
+		range = entry->wdata.max_range;
+
+	/* Check that the range is within limits for the wheel, wheels
+	 * without range setting get it done in software */
+	if (range >= entry->wdata.min_range && range <= entry->wdata.max_range) {
+		if (entry->wdata.set_range) {
+			entry->wdata.set_range(hid, range);
+		}
+		entry->wdata.range = range;
+		lg4ff_update_curve(entry);
+	}
+
+	return count;
+}
+static DEVICE_ATTR(range, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_range_show, lg4ff_range_store);
+
+static ssize_t lg4ff_deadzone_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	size_t count;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->deadzone);
+	return count;
+}
+
+static ssize_t lg4ff_deadzone_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	unsigned value = simple_strtoul(buf, NULL, 10);
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
 	}
 
-	/* Adjust for non-MOMO wheels */
-	switch (entry->wdata.product_id) {
-	case USB_DEVICE_ID_LOGITECH_MOMO_WHEEL:
-	case USB_DEVICE_ID_LOGITECH_MOMO_WHEEL2:
-		break;
-	default:
-		expand_a = expand_a >> 1;
-		break;
+	if (value > 99) {
+		value = 99;
 	}
 
-	cmd[0] = 0xfe;
-	cmd[1] = 0x0d;
-	cmd[2] = expand_a / 0xaaaa;
-	cmd[3] = expand_a / 0xaaaa;
-	cmd[4] = expand_b / 0xaaaa;
-	cmd[5] = 0x00;
-	cmd[6] = 0x00;
-	lg4ff_send_cmd(entry, cmd);
+	entry->deadzone = value;
+	lg4ff_update_curve(entry);
 
-	/* Activate Auto-Center */
-	cmd[0] = 0x14;
-	cmd[1] = 0x00;
-	cmd[2] = 0x00;
-	cmd[3] = 0x00;
-	cmd[4] = 0x00;
-	cmd[5] = 0x00;
-	cmd[6] = 0x00;
-	lg4ff_send_cmd(entry, cmd);
+	return count;
 }
+static DEVICE_ATTR(deadzone, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_deadzone_show, lg4ff_deadzone_store);
 
-/* Sends autocentering command compatible with Formula Force EX */
-static void lg4ff_set_autocenter_ffex(struct input_dev *dev, u16 magnitude)
+static ssize_t lg4ff_linearity_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
 {
-	struct hid_device *hid = input_get_drvdata(dev);
+	struct hid_device *hid = to_hid_device(dev);
 	struct lg4ff_device_entry *entry;
-	u8 cmd[7];
+	size_t count;
 
 	entry = lg4ff_get_device_entry(hid);
 	if (entry == NULL) {
-		return;
+		return -EINVAL;
 	}
 
-	entry->wdata.autocenter = magnitude;
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->linearity);
+	return count;
+}
 
-	magnitude = magnitude * 90 / 65535;
+static ssize_t lg4ff_linearity_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	unsigned value = simple_strtoul(buf, NULL, 10);
 
-	cmd[0] = 0xfe;
-	cmd[1] = 0x03;
-	cmd[2] = magnitude >> 14;
-	cmd[3] = magnitude >> 14;
-	cmd[4] = magnitude;
-	cmd[5] = 0x00;
-	cmd[6] = 0x00;
-	lg4ff_send_cmd(entry, cmd);
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	if (value > 200) {
+		value = 200;
+	}
+
+	entry->linearity = value;
+	lg4ff_update_curve(entry);
+
+	return count;
 }
+static DEVICE_ATTR(linearity, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_linearity_show, lg4ff_linearity_store);
 
-/* Sends command to set range compatible with G25/G27/Driving Force GT */
-static void lg4ff_set_range_g25(struct hid_device *hid, u16 range)
+static ssize_t lg4ff_real_id_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
+	struct hid_device *hid = to_hid_device(dev);
 	struct lg4ff_device_entry *entry;
-	struct lg_drv_data *drv_data;
-	u8 cmd[7];
+	size_t count;
 
-	drv_data = hid_get_drvdata(hid);
-	entry = drv_data->device_props;
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
 
-	dbg_hid("G25/G27/DFGT: setting range to %u\n", range);
+	if (!entry->wdata.real_tag || !entry->wdata.real_name) {
+		hid_err(hid, "NULL pointer to string\n");
+		return 0;
+	}
 
-	cmd[0] = 0xf8;
-	cmd[1] = 0x81;
-	cmd[2] = range & 0x00ff;
-	cmd[3] = (range & 0xff00) >> 8;
-	cmd[4] = 0x00;
-	cmd[5] = 0x00;
-	cmd[6] = 0x00;
-	lg4ff_send_cmd(entry, cmd);
+	count = scnprintf(buf, PAGE_SIZE, "%s: %s\n", entry->wdata.real_tag, entry->wdata.real_name);
+	return count;
 }
 
-/* Sends commands to set range compatible with Driving Force Pro wheel */
-static void lg4ff_set_range_dfp(struct hid_device *hid, u16 range)
+static ssize_t lg4ff_real_id_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	/* Real ID is a read-only value */
+	return -EPERM;
+}
+static DEVICE_ATTR(real_id, S_IRUGO, lg4ff_real_id_show, lg4ff_real_id_store);
+
+/* Export the currently set gain of the wheel */
+static ssize_t lg4ff_gain_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
 {
+	struct hid_device *hid = to_hid_device(dev);
 	struct lg4ff_device_entry *entry;
-	struct lg_drv_data *drv_data;
-	int start_left, start_right, full_range;
-	u8 cmd[7];
+	size_t count;
 
-	drv_data = hid_get_drvdata(hid);
-	entry = drv_data->device_props;
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
 
-	dbg_hid("Driving Force Pro: setting range to %u\n", range);
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->wdata.master_gain);
+	return count;
+}
 
-	/* Prepare "coarse" limit command */
-	cmd[0] = 0xf8;
-	cmd[1] = 0x00;	/* Set later */
-	cmd[2] = 0x00;
-	cmd[3] = 0x00;
-	cmd[4] = 0x00;
-	cmd[5] = 0x00;
-	cmd[6] = 0x00;
+/* Set gain to user specified value, call appropriate function
+ * according to the type of the wheel */
+static ssize_t lg4ff_gain_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	u16 gain = simple_strtoul(buf, NULL, 10);
 
-	if (range > 200) {
-		cmd[1] = 0x03;
-		full_range = 900;
-	} else {
-		cmd[1] = 0x02;
-		full_range = 200;
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
 	}
-	lg4ff_send_cmd(entry, cmd);
 
-	/* Prepare "fine" limit command */
-	cmd[0] = 0x81;
-	cmd[1] = 0x0b;
-	cmd[2] = 0x00;
-	cmd[3] = 0x00;
-	cmd[4] = 0x00;
-	cmd[5] = 0x00;
-	cmd[6] = 0x00;
+	if (gain > 0xffff) {
+		gain = 0xffff;
+	}
 
-	if (range == 200 || range == 900) {	/* Do not apply any fine limit */
-		lg4ff_send_cmd(entry, cmd);
-		return;
+	entry->wdata.master_gain = gain;
+	lg4ff_update_scale(entry);
+
+	return count;
+}
+static DEVICE_ATTR(gain, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_gain_show, lg4ff_gain_store);
+
+/* Export the currently set autocenter of the wheel */
+static ssize_t lg4ff_autocenter_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	size_t count;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->wdata.autocenter);
+	return count;
+}
+
+/* Set autocenter to user specified value, call appropriate function
+ * according to the type of the wheel */
+static ssize_t lg4ff_autocenter_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct hid_input *hidinput = list_entry(hid->inputs.next, struct hid_input, list);
+	struct input_dev *inputdev = hidinput->input;
+	u16 autocenter = simple_strtoul(buf, NULL, 10);
+
+	if (autocenter > 0xffff) {
+		autocenter = 0xffff;
+	}
+
+	inputdev->ff->set_autocenter(inputdev, autocenter);
+
+	return count;
+}
+static DEVICE_ATTR(autocenter, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_autocenter_show, lg4ff_autocenter_store);
+
+static ssize_t lg4ff_spring_level_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	size_t count;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->spring_level);
+
+	return count;
+}
+
+static ssize_t lg4ff_spring_level_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	unsigned value = simple_strtoul(buf, NULL, 10);
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	if (value > 100) {
+		value = 100;
+	}
+
+	entry->spring_level = value;
+	lg4ff_update_scale(entry);
+
+	return count;
+}
+static DEVICE_ATTR(spring_level, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_spring_level_show, lg4ff_spring_level_store);
+
+static ssize_t lg4ff_damper_level_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	size_t count;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->damper_level);
+
+	return count;
+}
+
+static ssize_t lg4ff_damper_level_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	unsigned value = simple_strtoul(buf, NULL, 10);
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	if (value > 100) {
+		value = 100;
+	}
+
+	entry->damper_level = value;
+	lg4ff_update_scale(entry);
+
+	return count;
+}
+static DEVICE_ATTR(damper_level, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_damper_level_show, lg4ff_damper_level_store);
+
+static ssize_t lg4ff_friction_level_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	size_t count;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
 	}
 
-	/* Construct fine limit command */
-	start_left = (((full_range - range + 1) * 2047) / full_range);
-	start_right = 0xfff - start_left;
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->friction_level);
 
-	cmd[2] = start_left >> 4;
-	cmd[3] = start_right >> 4;
-	cmd[4] = 0xff;
-	cmd[5] = (start_right & 0xe) << 4 | (start_left & 0xe);
-	cmd[6] = 0xff;
-	lg4ff_send_cmd(entry, cmd);
+	return count;
 }
 
-static void lg4ff_set_gain(struct input_dev *dev, u16 gain)
+static ssize_t lg4ff_friction_level_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
 {
-	struct hid_device *hid = input_get_drvdata(dev);
+	struct hid_device *hid = to_hid_device(dev);
 	struct lg4ff_device_entry *entry;
+	unsigned value = simple_strtoul(buf, NULL, 10);
 
 	entry = lg4ff_get_device_entry(hid);
 	if (entry == NULL) {
-		return;
+		return -EINVAL;
 	}
 
-	entry->wdata.gain = gain;
+	if (value > 100) {
+		value = 100;
+	}
+
+	entry->friction_level = value;
+	lg4ff_update_scale(entry);
+
+	return count;
 }
+static DEVICE_ATTR(friction_level, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_friction_level_show, lg4ff_friction_level_store);
 
-static const struct lg4ff_compat_mode_switch *lg4ff_get_mode_switch_command(const u16 real_product_id, const u16 target_product_id)
+static ssize_t lg4ff_inertia_level_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
 {
-	switch (real_product_id) {
-	case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
-		switch (target_product_id) {
-		case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
-			return &lg4ff_mode_switch_ext01_dfp;
-		/* DFP can only be switched to its native mode */
-		default:
-			return NULL;
-		}
-		break;
-	case USB_DEVICE_ID_LOGITECH_G25_WHEEL:
-		switch (target_product_id) {
-		case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
-			return &lg4ff_mode_switch_ext01_dfp;
-		case USB_DEVICE_ID_LOGITECH_G25_WHEEL:
-			return &lg4ff_mode_switch_ext16_g25;
-		/* G25 can only be switched to DFP mode or its native mode */
-		default:
-			return NULL;
-		}
-		break;
-	case USB_DEVICE_ID_LOGITECH_G27_WHEEL:
-		switch (target_product_id) {
-		case USB_DEVICE_ID_LOGITECH_WHEEL:
-			return &lg4ff_mode_switch_ext09_dfex;
-		case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
-			return &lg4ff_mode_switch_ext09_dfp;
-		case USB_DEVICE_ID_LOGITECH_G25_WHEEL:
-			return &lg4ff_mode_switch_ext09_g25;
-		case USB_DEVICE_ID_LOGITECH_G27_WHEEL:
-			return &lg4ff_mode_switch_ext09_g27;
-		/* G27 can only be switched to DF-EX, DFP, G25 or its native mode */
-		default:
-			return NULL;
-		}
-		break;
-	case USB_DEVICE_ID_LOGITECH_G29_WHEEL:
-		switch (target_product_id) {
-		case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
-			return &lg4ff_mode_switch_ext09_dfp;
-		case USB_DEVICE_ID_LOGITECH_DFGT_WHEEL:
-			return &lg4ff_mode_switch_ext09_dfgt;
-		case USB_DEVICE_ID_LOGITECH_G25_WHEEL:
-			return &lg4ff_mode_switch_ext09_g25;
-		case USB_DEVICE_ID_LOGITECH_G27_WHEEL:
-			return &lg4ff_mode_switch_ext09_g27;
-		case USB_DEVICE_ID_LOGITECH_G29_WHEEL:
-			return &lg4ff_mode_switch_ext09_g29;
-		/* G29 can only be switched to DF-EX, DFP, DFGT, G25, G27 or its native mode */
-		default:
-			return NULL;
-		}
-		break;
-	case USB_DEVICE_ID_LOGITECH_G923_PS_WHEEL:
-		switch (target_product_id) {
-		case USB_DEVICE_ID_LOGITECH_G923_WHEEL:
-			return &lg4ff_mode_switch_30_g923;
-		/* We can only switch from PS mode to Classic. */
-		default:
-			return NULL;
-		}
-		break;
-	case USB_DEVICE_ID_LOGITECH_DFGT_WHEEL:
-		switch (target_product_id) {
-		case USB_DEVICE_ID_LOGITECH_WHEEL:
-			return &lg4ff_mode_switch_ext09_dfex;
-		case USB_DEVICE_ID_LOGITECH_DFP_WHEEL:
-			return &lg4ff_mode_switch_ext09_dfp;
-		case USB_DEVICE_ID_LOGITECH_DFGT_WHEEL:
-			return &lg4ff_mode_switch_ext09_dfgt;
-		/* DFGT can only be switched to DF-EX, DFP or its native mode */
-		default:
-			return NULL;
-		}
-		break;
-	/* No other wheels have multiple modes */
-	default:
-		return NULL;
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	size_t count;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
 	}
+
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->inertia_level);
+
+	return count;
 }
 
-static int lg4ff_switch_compatibility_mode(struct hid_device *hid, const struct lg4ff_compat_mode_switch *s)
+static ssize_t lg4ff_inertia_level_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
 {
+	struct hid_device *hid = to_hid_device(dev);
 	struct lg4ff_device_entry *entry;
-	u8 cmd[7];
-	u8 i;
+	unsigned value = simple_strtoul(buf, NULL, 10);
 
 	entry = lg4ff_get_device_entry(hid);
 	if (entry == NULL) {
 		return -EINVAL;
 	}
 
-	for (i = 0; i < s->cmd_count; i++) {
-		u8 j;
+	if (value > 100) {
+		value = 100;
+	}
 
-		for (j = 0; j < 7; j++)
-			cmd[j] = s->cmd[j + (7*i)];
+	entry->inertia_level = value;
+	lg4ff_update_scale(entry);
 
-		lg4ff_send_cmd(entry, cmd);
-	}
-	hid_hw_wait(hid);
-	return 0;
+	return count;
 }
+static DEVICE_ATTR(inertia_level, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_inertia_level_show, lg4ff_inertia_level_store);
 
-/* For switching from PS mode we need to set report id to 0x30 */
-static int lg4ff_switch_from_ps_mode(struct hid_device *hid, const struct lg4ff_compat_mode_switch *s)
+static ssize_t lg4ff_peak_ffb_level_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
 {
+	struct hid_device *hid = to_hid_device(dev);
 	struct lg4ff_device_entry *entry;
-	u8 cmd[7];
-	u8 i;
+	size_t count;
 
 	entry = lg4ff_get_device_entry(hid);
 	if (entry == NULL) {
 		return -EINVAL;
 	}
 
-	for (i = 0; i < s->cmd_count; i++) {
-		u8 j;
-
-		for (j = 0; j < 7; j++)
-			cmd[j] = s->cmd[j + (7*i)];
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->peak_ffb_level);
 
-		lg4ff_send_cmd_with_id(entry, cmd, 0x30);
-	}
-	hid_hw_wait(hid);
-	return 0;
+	return count;
 }
 
-static ssize_t lg4ff_alternate_modes_show(struct device *dev, struct device_attribute *attr, char *buf)
+static ssize_t lg4ff_peak_ffb_level_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
 {
 	struct hid_device *hid = to_hid_device(dev);
 	struct lg4ff_device_entry *entry;
-	ssize_t count = 0;
-	int i;
+	unsigned long value = simple_strtoul(buf, NULL, 10);
 
 	entry = lg4ff_get_device_entry(hid);
 	if (entry == NULL) {
 		return -EINVAL;
 	}
 
-	if (!entry->wdata.real_name) {
-		hid_err(hid, "NULL pointer to string\n");
-		return 0;
-	}
+	entry->peak_ffb_level = value;
 
-	for (i = 0; i < LG4FF_MODE_MAX_IDX; i++) {
-		if (entry->wdata.alternate_modes & BIT(i)) {
-			/* Print tag and full name */
-			count += scnprintf(buf + count, PAGE_SIZE - count, "%s: %s",
-					   lg4ff_alternate_modes[i].tag,
-					   !lg4ff_alternate_modes[i].product_id ? entry->wdata.real_name : lg4ff_alternate_modes[i].name);
-			if (count >= PAGE_SIZE - 1)
-				return count;
+	return count;
+}
+static DEVICE_ATTR(peak_ffb_level, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_peak_ffb_level_show, lg4ff_peak_ffb_level_store);
 
-			/* Mark the currently active mode with an asterisk */
-			if (lg4ff_alternate_modes[i].product_id == entry->wdata.product_id ||
-			    (lg4ff_alternate_modes[i].product_id == 0 && entry->wdata.product_id == entry->wdata.real_product_id))
-				count += scnprintf(buf + count, PAGE_SIZE - count, " *\n");
-			else
-				count += scnprintf(buf + count, PAGE_SIZE - count, "\n");
+static ssize_t lg4ff_timer_stats_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	struct lg4ff_rate_control *rate;
+	size_t count;
 
-			if (count >= PAGE_SIZE - 1)
-				return count;
-		}
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
 	}
 
+	rate = &entry->rate;
+	count = scnprintf(buf, PAGE_SIZE,
+			"period_us: %u\n"
+			"min_period_us: %u\n"
+			"max_period_us: %u\n"
+			"drain_us: %u\n"
+			"max_queue_depth: %u\n"
+			"ticks: %lu\n"
+			"busy_ticks: %lu\n"
+			"overruns: %lu\n"
+			"backoffs: %lu\n"
+			"recoveries: %lu\n",
+			rate->period, rate->min_period, rate->max_period, rate->drain_time, rate->max_depth,
+			rate->ticks, rate->busy_ticks, rate->overruns, rate->backoffs, rate->recoveries);
+
 	return count;
 }
 
-static ssize_t lg4ff_alternate_modes_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+static ssize_t lg4ff_timer_stats_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	/* Timer stats are read-only */
+	return -EPERM;
+}
+static DEVICE_ATTR(timer_stats, S_IRUGO, lg4ff_timer_stats_show, lg4ff_timer_stats_store);
+
+static ssize_t lg4ff_timer_usecs_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
 {
 	struct hid_device *hid = to_hid_device(dev);
 	struct lg4ff_device_entry *entry;
-	const struct lg4ff_compat_mode_switch *s;
-	u16 target_product_id = 0;
-	int i, ret;
-	char *lbuf;
+	size_t count;
 
 	entry = lg4ff_get_device_entry(hid);
 	if (entry == NULL) {
 		return -EINVAL;
 	}
 
-	/* Allow \n at the end of the input parameter */
-	lbuf = kasprintf(GFP_KERNEL, "%s", buf);
-	if (!lbuf)
-		return -ENOMEM;
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->rate.min_period);
 
-	i = strlen(lbuf);
+	return count;
+}
 
-	if (i == 0) {
-		kfree(lbuf);
+static ssize_t lg4ff_timer_usecs_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	unsigned value = simple_strtoul(buf, NULL, 10);
+	unsigned long flags;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
 		return -EINVAL;
 	}
 
-	if (lbuf[i-1] == '\n') {
-		if (i == 1) {
-			kfree(lbuf);
-			return -EINVAL;
-		}
-		lbuf[i-1] = '\0';
-	}
+	spin_lock_irqsave(&entry->timer_lock, flags);
+	lg4ff_set_timer_period(entry, value);
+	spin_unlock_irqrestore(&entry->timer_lock, flags);
 
-	for (i = 0; i < LG4FF_MODE_MAX_IDX; i++) {
-		const u16 mode_product_id = lg4ff_alternate_modes[i].product_id;
-		const char *tag = lg4ff_alternate_modes[i].tag;
+	return count;
+}
+static DEVICE_ATTR(timer_usecs, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_timer_usecs_show, lg4ff_timer_usecs_store);
 
-		if (entry->wdata.alternate_modes & BIT(i)) {
-			if (!strcmp(tag, lbuf)) {
-				if (!mode_product_id)
-					target_product_id = entry->wdata.real_product_id;
-				else
-					target_product_id = mode_product_id;
-				break;
-			}
-		}
-	}
+static ssize_t lg4ff_timer_mode_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	size_t count;
 
-	if (i == LG4FF_MODE_MAX_IDX) {
-		hid_info(hid, "Requested mode \"%s\" is not supported by the device\n", lbuf);
-		kfree(lbuf);
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
 		return -EINVAL;
 	}
-	kfree(lbuf); /* Not needed anymore */
 
-	if (target_product_id == entry->wdata.product_id) /* Nothing to do */
-		return count;
+	count = scnprintf(buf, PAGE_SIZE, "%d\n", entry->timer_mode);
 
-	/* Automatic switching has to be disabled for the switch to DF-EX mode to work correctly */
-	if (target_product_id == USB_DEVICE_ID_LOGITECH_WHEEL && !lg4ff_no_autoswitch) {
-		hid_info(hid, "\"%s\" cannot be switched to \"DF-EX\" mode. Load the \"hid_logitech\" module with \"lg4ff_no_autoswitch=1\" parameter set and try again\n",
-			 entry->wdata.real_name);
-		return -EINVAL;
-	}
+	return count;
+}
 
-	/* Take care of hardware limitations */
-	if ((entry->wdata.real_product_id == USB_DEVICE_ID_LOGITECH_DFP_WHEEL || entry->wdata.real_product_id == USB_DEVICE_ID_LOGITECH_G25_WHEEL) &&
-	    entry->wdata.product_id > target_product_id) {
-		hid_info(hid, "\"%s\" cannot be switched back into \"%s\" mode\n", entry->wdata.real_name, lg4ff_alternate_modes[i].name);
+static ssize_t lg4ff_timer_mode_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	unsigned value = simple_strtoul(buf, NULL, 10);
+	unsigned long flags;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
 		return -EINVAL;
 	}
 
-	s = lg4ff_get_mode_switch_command(entry->wdata.real_product_id, target_product_id);
-	if (!s) {
-		hid_err(hid, "Invalid target product ID %X\n", target_product_id);
+	if (value > 3) {
 		return -EINVAL;
 	}
 
-	ret = lg4ff_switch_compatibility_mode(hid, s);
-	return (ret == 0 ? count : ret);
+	spin_lock_irqsave(&entry->timer_lock, flags);
+	entry->timer_mode = value;
+	lg4ff_set_timer_period(entry, entry->rate.min_period);
+	spin_unlock_irqrestore(&entry->timer_lock, flags);
+
+	return count;
 }
-static DEVICE_ATTR(alternate_modes, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_alternate_modes_show, lg4ff_alternate_modes_store);
+static DEVICE_ATTR(timer_mode, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_timer_mode_show, lg4ff_timer_mode_store);
 
-static ssize_t lg4ff_combine_show(struct device *dev, struct device_attribute *attr,
+static ssize_t lg4ff_fast_constant_show(struct device *dev, struct device_attribute *attr,
 				char *buf)
 {
 	struct hid_device *hid = to_hid_device(dev);
@@ -1735,32 +4383,30 @@ static ssize_t lg4ff_combine_show(struct device *dev, struct device_attribute *a
 		return -EINVAL;
 	}
 
-	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->wdata.combine);
+	count = scnprintf(buf, PAGE_SIZE, "%d\n", entry->fast_constant);
+
 	return count;
 }
 
-static ssize_t lg4ff_combine_store(struct device *dev, struct device_attribute *attr,
+static ssize_t lg4ff_fast_constant_store(struct device *dev, struct device_attribute *attr,
 				 const char *buf, size_t count)
 {
 	struct hid_device *hid = to_hid_device(dev);
 	struct lg4ff_device_entry *entry;
-	u16 combine = simple_strtoul(buf, NULL, 10);
+	unsigned long value = simple_strtoul(buf, NULL, 10);
 
 	entry = lg4ff_get_device_entry(hid);
 	if (entry == NULL) {
 		return -EINVAL;
 	}
 
-	if (combine > 2)
-		combine = 2;
+	entry->fast_constant = value ? 1 : 0;
 
-	entry->wdata.combine = combine;
 	return count;
 }
-static DEVICE_ATTR(combine_pedals, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_combine_show, lg4ff_combine_store);
+static DEVICE_ATTR(fast_constant, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_fast_constant_show, lg4ff_fast_constant_store);
 
-/* Export the currently set range of the wheel */
-static ssize_t lg4ff_range_show(struct device *dev, struct device_attribute *attr,
+static ssize_t lg4ff_hw_periodic_show(struct device *dev, struct device_attribute *attr,
 				char *buf)
 {
 	struct hid_device *hid = to_hid_device(dev);
@@ -1772,39 +4418,37 @@ static ssize_t lg4ff_range_show(struct device *dev, struct device_attribute *att
 		return -EINVAL;
 	}
 
-	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->wdata.range);
+	count = scnprintf(buf, PAGE_SIZE, "%d\n", entry->hw_periodic);
+
 	return count;
 }
 
-/* Set range to user specified value, call appropriate function
- * according to the type of the wheel */
-static ssize_t lg4ff_range_store(struct device *dev, struct device_attribute *attr,
+/* The wave periods are counted in device loops, which only have a known
+ * length in fixed loop mode */
+static ssize_t lg4ff_hw_periodic_store(struct device *dev, struct device_attribute *attr,
 				 const char *buf, size_t count)
 {
 	struct hid_device *hid = to_hid_device(dev);
 	struct lg4ff_device_entry *entry;
-	u16 range = simple_strtoul(buf, NULL, 10);
+	unsigned long value = simple_strtoul(buf, NULL, 10);
 
 	entry = lg4ff_get_device_entry(hid);
 	if (entry == NULL) {
 		return -EINVAL;
 	}
 
-	if (range == 0)
-		range = entry->wdata.max_range;
-
-	/* Check if the wheel supports range setting
-	 * and that the range is within limits for the wheel */
-	if (entry->wdata.set_range && range >= entry->wdata.min_range && range <= entry->wdata.max_range) {
-		entry->wdata.set_range(hid, range);
-		entry->wdata.range = range;
+	if (value && !fixed_loop) {
+		return -EINVAL;
 	}
 
+	entry->hw_periodic = value ? 1 : 0;
+
 	return count;
 }
-static DEVICE_ATTR(range, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_range_show, lg4ff_range_store);
+static DEVICE_ATTR(hw_periodic, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_hw_periodic_show, lg4ff_hw_periodic_store);
 
-static ssize_t lg4ff_real_id_show(struct device *dev, struct device_attribute *attr, char *buf)
+static ssize_t lg4ff_smoothing_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
 {
 	struct hid_device *hid = to_hid_device(dev);
 	struct lg4ff_device_entry *entry;
@@ -1815,24 +4459,30 @@ static ssize_t lg4ff_real_id_show(struct device *dev, struct device_attribute *a
 		return -EINVAL;
 	}
 
-	if (!entry->wdata.real_tag || !entry->wdata.real_name) {
-		hid_err(hid, "NULL pointer to string\n");
-		return 0;
-	}
+	count = scnprintf(buf, PAGE_SIZE, "%d\n", entry->smoothing);
 
-	count = scnprintf(buf, PAGE_SIZE, "%s: %s\n", entry->wdata.real_tag, entry->wdata.real_name);
 	return count;
 }
 
-static ssize_t lg4ff_real_id_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+static ssize_t lg4ff_smoothing_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
 {
-	/* Real ID is a read-only value */
-	return -EPERM;
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
+	unsigned long value = simple_strtoul(buf, NULL, 10);
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	entry->smoothing = value ? 1 : 0;
+
+	return count;
 }
-static DEVICE_ATTR(real_id, S_IRUGO, lg4ff_real_id_show, lg4ff_real_id_store);
+static DEVICE_ATTR(smoothing, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_smoothing_show, lg4ff_smoothing_store);
 
-/* Export the currently set gain of the wheel */
-static ssize_t lg4ff_gain_show(struct device *dev, struct device_attribute *attr,
+static ssize_t lg4ff_dithering_show(struct device *dev, struct device_attribute *attr,
 				char *buf)
 {
 	struct hid_device *hid = to_hid_device(dev);
@@ -1844,36 +4494,30 @@ static ssize_t lg4ff_gain_show(struct device *dev, struct device_attribute *attr
 		return -EINVAL;
 	}
 
-	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->wdata.master_gain);
+	count = scnprintf(buf, PAGE_SIZE, "%d\n", entry->dithering);
+
 	return count;
 }
 
-/* Set gain to user specified value, call appropriate function
- * according to the type of the wheel */
-static ssize_t lg4ff_gain_store(struct device *dev, struct device_attribute *attr,
+static ssize_t lg4ff_dithering_store(struct device *dev, struct device_attribute *attr,
 				 const char *buf, size_t count)
 {
 	struct hid_device *hid = to_hid_device(dev);
 	struct lg4ff_device_entry *entry;
-	u16 gain = simple_strtoul(buf, NULL, 10);
+	unsigned long value = simple_strtoul(buf, NULL, 10);
 
 	entry = lg4ff_get_device_entry(hid);
 	if (entry == NULL) {
 		return -EINVAL;
 	}
 
-	if (gain > 0xffff) {
-		gain = 0xffff;
-	}
-
-	entry->wdata.master_gain = gain;
+	entry->dithering = value ? 1 : 0;
 
 	return count;
 }
-static DEVICE_ATTR(gain, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_gain_show, lg4ff_gain_store);
+static DEVICE_ATTR(dithering, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_dithering_show, lg4ff_dithering_store);
 
-/* Export the currently set autocenter of the wheel */
-static ssize_t lg4ff_autocenter_show(struct device *dev, struct device_attribute *attr,
+static ssize_t lg4ff_hysteresis_show(struct device *dev, struct device_attribute *attr,
 				char *buf)
 {
 	struct hid_device *hid = to_hid_device(dev);
@@ -1885,106 +4529,470 @@ static ssize_t lg4ff_autocenter_show(struct device *dev, struct device_attribute
 		return -EINVAL;
 	}
 
-	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->wdata.autocenter);
+	count = scnprintf(buf, PAGE_SIZE, "%u %u %u %u\n", entry->slots[0].threshold,
+			entry->slots[1].threshold, entry->slots[2].threshold,
+			entry->slots[3].threshold);
+
 	return count;
 }
 
-/* Set autocenter to user specified value, call appropriate function
- * according to the type of the wheel */
-static ssize_t lg4ff_autocenter_store(struct device *dev, struct device_attribute *attr,
+/* Takes one threshold for every slot or one for each slot */
+static ssize_t lg4ff_hysteresis_store(struct device *dev, struct device_attribute *attr,
 				 const char *buf, size_t count)
 {
 	struct hid_device *hid = to_hid_device(dev);
-	struct hid_input *hidinput = list_entry(hid->inputs.next, struct hid_input, list);
-	struct input_dev *inputdev = hidinput->input;
-	u16 autocenter = simple_strtoul(buf, NULL, 10);
+	struct lg4ff_device_entry *entry;
+	unsigned value[4];
+	int ret;
+	int i;
 
-	if (autocenter > 0xffff) {
-		autocenter = 0xffff;
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
 	}
 
-	inputdev->ff->set_autocenter(inputdev, autocenter);
+	ret = sscanf(buf, "%u %u %u %u", &value[0], &value[1], &value[2], &value[3]);
+	if (ret == 1) {
+		value[1] = value[2] = value[3] = value[0];
+	} else if (ret != 4) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < 4; i++) {
+		entry->slots[i].threshold = min(value[i], 255U);
+	}
 
 	return count;
 }
-static DEVICE_ATTR(autocenter, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_autocenter_show, lg4ff_autocenter_store);
+static DEVICE_ATTR(hysteresis, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_hysteresis_show, lg4ff_hysteresis_store);
 
-static ssize_t lg4ff_spring_level_show(struct device *dev, struct device_attribute *attr,
+static ssize_t lg4ff_hysteresis_usecs_show(struct device *dev, struct device_attribute *attr,
 				char *buf)
 {
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
 	size_t count;
 
-	count = scnprintf(buf, PAGE_SIZE, "%u\n", spring_level);
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->hysteresis_time);
 
 	return count;
 }
 
-static ssize_t lg4ff_spring_level_store(struct device *dev, struct device_attribute *attr,
+static ssize_t lg4ff_hysteresis_usecs_store(struct device *dev, struct device_attribute *attr,
 				 const char *buf, size_t count)
 {
+	struct hid_device *hid = to_hid_device(dev);
+	struct lg4ff_device_entry *entry;
 	unsigned value = simple_strtoul(buf, NULL, 10);
 
-	if (value > 100) {
-		value = 100;
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return -EINVAL;
+	}
+
+	entry->hysteresis_time = clamp(value, 0U, 1000000U);
+
+	return count;
+}
+static DEVICE_ATTR(hysteresis_usecs, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_hysteresis_usecs_show, lg4ff_hysteresis_usecs_store);
+
+#ifdef CONFIG_DEBUG_FS
+static int lg4ff_hist_show(struct seq_file *m, void *unused)
+{
+	struct lg4ff_histogram hist = *(struct lg4ff_histogram *)m->private;
+	int last = 0;
+	int i;
+
+	seq_printf(m, "count %lu\n", hist.count);
+	seq_printf(m, "mean %llu\n", hist.count ? div64_u64(hist.sum, hist.count) : 0);
+	seq_printf(m, "max %lu\n", hist.max);
+
+	for (i = 0; i < LG4FF_HIST_BUCKETS; i++) {
+		if (hist.buckets[i]) {
+			last = i;
+		}
+	}
+	for (i = 0; i <= last; i++) {
+		if (i == 0) {
+			seq_printf(m, "%10u %10u: %lu\n", 0, 0, hist.buckets[i]);
+		} else if (i == LG4FF_HIST_BUCKETS - 1) {
+			seq_printf(m, "%10lu        inf: %lu\n", 1UL << (i - 1), hist.buckets[i]);
+		} else {
+			seq_printf(m, "%10lu %10lu: %lu\n", 1UL << (i - 1), (1UL << i) - 1, hist.buckets[i]);
+		}
+	}
+
+	return 0;
+}
+
+static int lg4ff_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lg4ff_hist_show, inode->i_private);
+}
+
+/* Any write clears the histogram */
+static ssize_t lg4ff_hist_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+
+	memset(m->private, 0, sizeof(struct lg4ff_histogram));
+
+	return count;
+}
+
+static const struct file_operations lg4ff_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = lg4ff_hist_open,
+	.read = seq_read,
+	.write = lg4ff_hist_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int lg4ff_commands_show(struct seq_file *m, void *unused)
+{
+	struct lg4ff_stats *stats = m->private;
+
+	seq_printf(m, "sent %lu\n", stats->sent);
+	seq_printf(m, "suppressed %lu\n", stats->suppressed);
+	seq_printf(m, "held %lu\n", stats->held);
+	seq_printf(m, "immediate %lu\n", stats->immediate);
+	seq_printf(m, "deferred %lu\n", stats->deferred);
+	seq_printf(m, "direct %lu\n", stats->direct);
+	seq_printf(m, "throttled %lu\n", stats->throttled);
+
+	return 0;
+}
+
+static int lg4ff_commands_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lg4ff_commands_show, inode->i_private);
+}
+
+static ssize_t lg4ff_commands_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct lg4ff_stats *stats = m->private;
+
+	stats->sent = 0;
+	stats->suppressed = 0;
+	stats->held = 0;
+	stats->immediate = 0;
+	stats->deferred = 0;
+	stats->direct = 0;
+	stats->throttled = 0;
+
+	return count;
+}
+
+static const struct file_operations lg4ff_commands_fops = {
+	.owner = THIS_MODULE,
+	.open = lg4ff_commands_open,
+	.read = seq_read,
+	.write = lg4ff_commands_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+struct lg4ff_capture_snapshot {
+	unsigned int count;
+	struct lg4ff_capture_record records[];
+};
+
+/* Copy the ring oldest record first. Capturing pauses meanwhile so that the
+ * timer doesn't wait for the copy. */
+static struct lg4ff_capture_snapshot *lg4ff_capture_snapshot(struct lg4ff_capture *capture)
+{
+	struct lg4ff_capture_snapshot *snapshot;
+	unsigned long flags;
+	unsigned long first;
+	unsigned int i;
+	int active;
+
+	snapshot = vmalloc(sizeof(*snapshot) + LG4FF_CAPTURE_SIZE * sizeof(snapshot->records[0]));
+	if (!snapshot) {
+		return NULL;
+	}
+
+	mutex_lock(&capture->mutex);
+
+	spin_lock_irqsave(&capture->lock, flags);
+	active = capture->active;
+	capture->active = 0;
+	snapshot->count = capture->records ? min_t(unsigned long, capture->head, LG4FF_CAPTURE_SIZE) : 0;
+	first = capture->head - snapshot->count;
+	spin_unlock_irqrestore(&capture->lock, flags);
+
+	for (i = 0; i < snapshot->count; i++) {
+		snapshot->records[i] = capture->records[(first + i) & (LG4FF_CAPTURE_SIZE - 1)];
+	}
+
+	spin_lock_irqsave(&capture->lock, flags);
+	capture->active = active;
+	spin_unlock_irqrestore(&capture->lock, flags);
+
+	mutex_unlock(&capture->mutex);
+
+	return snapshot;
+}
+
+static void lg4ff_capture_show_effect(struct seq_file *m, const struct ff_effect *effect)
+{
+	const struct ff_envelope *envelope = NULL;
+	const struct ff_condition_effect *condition;
+	int i;
+
+	seq_printf(m, " %d %#x %u %u %u", effect->id, effect->type, effect->direction,
+			effect->replay.delay, effect->replay.length);
+
+	switch (effect->type) {
+		case FF_CONSTANT:
+			seq_printf(m, " %d", effect->u.constant.level);
+			envelope = &effect->u.constant.envelope;
+			break;
+		case FF_RAMP:
+			seq_printf(m, " %d %d", effect->u.ramp.start_level, effect->u.ramp.end_level);
+			envelope = &effect->u.ramp.envelope;
+			break;
+		case FF_PERIODIC:
+			seq_printf(m, " %#x %u %d %d %u", effect->u.periodic.waveform, effect->u.periodic.period,
+					effect->u.periodic.magnitude, effect->u.periodic.offset, effect->u.periodic.phase);
+			envelope = &effect->u.periodic.envelope;
+			break;
+		case FF_SPRING:
+		case FF_DAMPER:
+		case FF_FRICTION:
+		case FF_INERTIA:
+			for (i = 0; i < 2; i++) {
+				condition = &effect->u.condition[i];
+				seq_printf(m, " %u %u %d %d %u %d", condition->right_saturation, condition->left_saturation,
+						condition->right_coeff, condition->left_coeff, condition->deadband, condition->center);
+			}
+			break;
+	}
+
+	if (envelope) {
+		seq_printf(m, " %u %u %u %u", envelope->attack_length, envelope->attack_level,
+				envelope->fade_length, envelope->fade_level);
+	}
+}
+
+static int lg4ff_capture_show(struct seq_file *m, void *unused)
+{
+	struct lg4ff_capture_snapshot *snapshot = m->private;
+	struct lg4ff_capture_record *record;
+	unsigned int i;
+
+	seq_puts(m, "# time upload id type direction delay length parameters [envelope]\n");
+	seq_puts(m, "# time play id value\n");
+	seq_puts(m, "# time cmd bytes\n");
+
+	for (i = 0; i < snapshot->count; i++) {
+		record = &snapshot->records[i];
+		switch (record->kind) {
+			case LG4FF_CAPTURE_UPLOAD:
+				seq_printf(m, "%lu upload", record->time);
+				lg4ff_capture_show_effect(m, &record->data.effect);
+				seq_putc(m, '\n');
+				break;
+			case LG4FF_CAPTURE_PLAY:
+				seq_printf(m, "%lu play %d %d\n", record->time, record->data.play.effect_id, record->data.play.value);
+				break;
+			case LG4FF_CAPTURE_CMD:
+				seq_printf(m, "%lu cmd %*ph\n", record->time, 7, record->data.cmd);
+				break;
+		}
+	}
+
+	return 0;
+}
+
+static int lg4ff_capture_open(struct inode *inode, struct file *file)
+{
+	struct lg4ff_device_entry *entry = inode->i_private;
+	struct lg4ff_capture_snapshot *snapshot;
+	int ret;
+
+	snapshot = lg4ff_capture_snapshot(&entry->capture);
+	if (!snapshot) {
+		return -ENOMEM;
+	}
+
+	ret = single_open_size(file, lg4ff_capture_show, snapshot, (snapshot->count + 4) * 128);
+	if (ret) {
+		vfree(snapshot);
+	}
+
+	return ret;
+}
+
+static int lg4ff_capture_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = file->private_data;
+
+	vfree(m->private);
+
+	return single_release(inode, file);
+}
+
+/* Writing 1 clears the ring and starts capturing, the effects already
+ * playing are recorded first as uploaded and started at that time. Writing
+ * 0 stops capturing. */
+static ssize_t lg4ff_capture_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct lg4ff_device_entry *entry = file_inode(file)->i_private;
+	struct lg4ff_capture *capture = &entry->capture;
+	struct lg4ff_capture_record *records = NULL;
+	struct lg4ff_effect_state *state;
+	unsigned long now = lg4ff_now();
+	unsigned long flags;
+	int effect_id;
+	int value;
+	int ret;
+
+	ret = kstrtoint_from_user(buf, count, 0, &value);
+	if (ret) {
+		return ret;
+	}
+
+	if (!value) {
+		spin_lock_irqsave(&capture->lock, flags);
+		capture->active = 0;
+		spin_unlock_irqrestore(&capture->lock, flags);
+		return count;
+	}
+
+	if (!READ_ONCE(capture->records)) {
+		records = vzalloc(LG4FF_CAPTURE_SIZE * sizeof(*records));
+		if (!records) {
+			return -ENOMEM;
+		}
 	}
 
-	spring_level = value;
+	mutex_lock(&capture->mutex);
+	spin_lock_irqsave(&entry->timer_lock, flags);
 
-	return count;
-}
-static DEVICE_ATTR(spring_level, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_spring_level_show, lg4ff_spring_level_store);
+	spin_lock(&capture->lock);
+	if (!capture->records) {
+		capture->records = records;
+		records = NULL;
+	}
+	capture->head = 0;
+	capture->active = 1;
+	spin_unlock(&capture->lock);
 
-static ssize_t lg4ff_damper_level_show(struct device *dev, struct device_attribute *attr,
-				char *buf)
-{
-	size_t count;
+	for_each_set_bit(effect_id, entry->active_effects, LG4FF_MAX_EFFECTS) {
+		state = &entry->states[effect_id];
+		lg4ff_capture_upload(entry, state->effect, now);
+		lg4ff_capture_play(entry, effect_id, max_t(int, state->count, 1), now);
+	}
+
+	spin_unlock_irqrestore(&entry->timer_lock, flags);
+	mutex_unlock(&capture->mutex);
 
-	count = scnprintf(buf, PAGE_SIZE, "%u\n", damper_level);
+	vfree(records);
 
 	return count;
 }
 
-static ssize_t lg4ff_damper_level_store(struct device *dev, struct device_attribute *attr,
-				 const char *buf, size_t count)
+static const struct file_operations lg4ff_capture_fops = {
+	.owner = THIS_MODULE,
+	.open = lg4ff_capture_open,
+	.read = seq_read,
+	.write = lg4ff_capture_write,
+	.llseek = seq_lseek,
+	.release = lg4ff_capture_release,
+};
+
+/* Statistics go in the HID core debugfs directory of the device */
+/* The ring is only allocated once somebody maps it */
+static int lg4ff_telemetry_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	unsigned value = simple_strtoul(buf, NULL, 10);
+	struct lg4ff_device_entry *entry = file->private_data;
+	struct lg4ff_telemetry *telemetry;
+	size_t size = LG4FF_TELEMETRY_OFFSET + LG4FF_TELEMETRY_RECORDS * sizeof(struct lg4ff_telemetry_record);
+	unsigned long flags;
+	int ret;
 
-	if (value > 100) {
-		value = 100;
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
 	}
+	/* Keep mprotect from making it writable later */
+	vm_flags_clear(vma, VM_MAYWRITE);
 
-	damper_level = value;
-
-	return count;
-}
-static DEVICE_ATTR(damper_level, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_damper_level_show, lg4ff_damper_level_store);
+	/* Created unsafe for mmap to work, keep the device from going away */
+	ret = debugfs_file_get(file->f_path.dentry);
+	if (ret) {
+		return ret;
+	}
 
-static ssize_t lg4ff_friction_level_show(struct device *dev, struct device_attribute *attr,
-				char *buf)
-{
-	size_t count;
+	telemetry = NULL;
+	if (!READ_ONCE(entry->telemetry)) {
+		telemetry = vmalloc_user(size);
+		if (!telemetry) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		telemetry->version = LG4FF_TELEMETRY_VERSION;
+		telemetry->records = LG4FF_TELEMETRY_RECORDS;
+		telemetry->record_size = sizeof(struct lg4ff_telemetry_record);
+		telemetry->offset = LG4FF_TELEMETRY_OFFSET;
+	}
 
-	count = scnprintf(buf, PAGE_SIZE, "%u\n", friction_level);
+	spin_lock_irqsave(&entry->timer_lock, flags);
+	if (!entry->telemetry) {
+		entry->telemetry = telemetry;
+		telemetry = NULL;
+	}
+	spin_unlock_irqrestore(&entry->timer_lock, flags);
+	vfree(telemetry);
 
-	return count;
+	ret = remap_vmalloc_range(vma, entry->telemetry, vma->vm_pgoff);
+out:
+	debugfs_file_put(file->f_path.dentry);
+	return ret;
 }
 
-static ssize_t lg4ff_friction_level_store(struct device *dev, struct device_attribute *attr,
-				 const char *buf, size_t count)
+static const struct file_operations lg4ff_telemetry_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.mmap = lg4ff_telemetry_mmap,
+};
+
+static void lg4ff_init_debugfs(struct lg4ff_device_entry *entry)
 {
-	unsigned value = simple_strtoul(buf, NULL, 10);
+	struct lg4ff_stats *stats = &entry->stats;
 
-	if (value > 100) {
-		value = 100;
-	}
+	spin_lock_init(&entry->capture.lock);
+	mutex_init(&entry->capture.mutex);
 
-	friction_level = value;
+	entry->debug_dir = debugfs_create_dir("lg4ff", entry->hid->debug_dir);
+	if (IS_ERR_OR_NULL(entry->debug_dir)) {
+		entry->debug_dir = NULL;
+		return;
+	}
 
-	return count;
+	debugfs_create_file("jitter", 0600, entry->debug_dir, &stats->jitter, &lg4ff_hist_fops);
+	debugfs_create_file("latency", 0600, entry->debug_dir, &stats->latency, &lg4ff_hist_fops);
+	debugfs_create_file("compute", 0600, entry->debug_dir, &stats->compute, &lg4ff_hist_fops);
+	debugfs_create_file("skip_depth", 0600, entry->debug_dir, &stats->skip_depth, &lg4ff_hist_fops);
+	debugfs_create_file("commands", 0600, entry->debug_dir, stats, &lg4ff_commands_fops);
+	debugfs_create_file("capture", 0600, entry->debug_dir, entry, &lg4ff_capture_fops);
+	debugfs_create_file_unsafe("telemetry", 0400, entry->debug_dir, entry, &lg4ff_telemetry_fops);
 }
-static DEVICE_ATTR(friction_level, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_friction_level_show, lg4ff_friction_level_store);
+#endif
 
-static ssize_t lg4ff_peak_ffb_level_show(struct device *dev, struct device_attribute *attr,
+#ifdef CONFIG_LEDS_CLASS
+
+static ssize_t lg4ff_ffb_leds_show(struct device *dev, struct device_attribute *attr,
 				char *buf)
 {
 	struct hid_device *hid = to_hid_device(dev);
@@ -1996,12 +5004,12 @@ static ssize_t lg4ff_peak_ffb_level_show(struct device *dev, struct device_attri
 		return -EINVAL;
 	}
 
-	count = scnprintf(buf, PAGE_SIZE, "%u\n", entry->peak_ffb_level);
+	count = scnprintf(buf, PAGE_SIZE, "%d\n", entry->ffb_leds);
 
 	return count;
 }
 
-static ssize_t lg4ff_peak_ffb_level_store(struct device *dev, struct device_attribute *attr,
+static ssize_t lg4ff_ffb_leds_store(struct device *dev, struct device_attribute *attr,
 				 const char *buf, size_t count)
 {
 	struct hid_device *hid = to_hid_device(dev);
@@ -2013,30 +5021,21 @@ static ssize_t lg4ff_peak_ffb_level_store(struct device *dev, struct device_attr
 		return -EINVAL;
 	}
 
-	entry->peak_ffb_level = value;
-
-	return count;
-}
-static DEVICE_ATTR(peak_ffb_level, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH, lg4ff_peak_ffb_level_show, lg4ff_peak_ffb_level_store);
-
-#ifdef CONFIG_LEDS_CLASS
-
-static ssize_t lg4ff_ffb_leds_show(struct device *dev, struct device_attribute *attr,
-				char *buf)
-{
-	size_t count;
-
-	count = scnprintf(buf, PAGE_SIZE, "%d\n", ffb_leds);
-
-	return count;
-}
-
-static ssize_t lg4ff_ffb_leds_store(struct device *dev, struct device_attribute *attr,
-				 const char *buf, size_t count)
-{
-	unsigned long value = simple_strtoul(buf, NULL, 10);
+	if (!value == !entry->ffb_leds) {
+		return count;
+	}
 
-	ffb_leds = value;
+	if (value) {
+		entry->leds_meter.state = entry->wdata.led_state;
+		entry->leds_meter.level = 0;
+		entry->leds_meter.refresh_at = lg4ff_now();
+		entry->ffb_leds = 1;
+	} else {
+		/* Give the leds back to the led class devices */
+		entry->ffb_leds = 0;
+		entry->leds_meter.is_updated = 0;
+		lg4ff_queue_leds(entry, entry->wdata.led_state);
+	}
 
 	return count;
 }
@@ -2062,6 +5061,21 @@ static void lg4ff_set_leds(struct hid_device *hid, u8 leds)
 	lg4ff_send_cmd(entry, cmd);
 }
 
+/* Led changes from userspace only keep the latest state */
+static void lg4ff_queue_leds(struct lg4ff_device_entry *entry, u8 leds)
+{
+	u8 cmd[1][7];
+
+	cmd[0][0] = 0xf8;
+	cmd[0][1] = 0x12;
+	cmd[0][2] = leds;
+	cmd[0][3] = 0x00;
+	cmd[0][4] = 0x00;
+	cmd[0][5] = 0x00;
+	cmd[0][6] = 0x00;
+	lg4ff_queue_control(entry, LG4FF_CTRL_LEDS, cmd, 1);
+}
+
 static void lg4ff_led_set_brightness(struct led_classdev *led_cdev,
 			enum led_brightness value)
 {
@@ -2081,13 +5095,13 @@ static void lg4ff_led_set_brightness(struct led_classdev *led_cdev,
 		state = (entry->wdata.led_state >> i) & 1;
 		if (value == LED_OFF && state) {
 			entry->wdata.led_state &= ~(1 << i);
-			if (!ffb_leds) {
-				lg4ff_set_leds(hid, entry->wdata.led_state);
+			if (!entry->ffb_leds) {
+				lg4ff_queue_leds(entry, entry->wdata.led_state);
 			}
 		} else if (value != LED_OFF && !state) {
 			entry->wdata.led_state |= 1 << i;
-			if (!ffb_leds) {
-				lg4ff_set_leds(hid, entry->wdata.led_state);
+			if (!entry->ffb_leds) {
+				lg4ff_queue_leds(entry, entry->wdata.led_state);
 			}
 		}
 		break;
@@ -2115,7 +5129,7 @@ static enum led_brightness lg4ff_led_get_brightness(struct led_classdev *led_cde
 	return value ? LED_FULL : LED_OFF;
 }
 
-static void lg4ff_init_leds(struct hid_device *hid, struct lg4ff_device_entry *entry, int i)
+static void lg4ff_init_leds(struct hid_device *hid, struct lg4ff_device_entry *entry)
 {
 	int error, j;
 
@@ -2129,7 +5143,7 @@ static void lg4ff_init_leds(struct hid_device *hid, struct lg4ff_device_entry *e
 		size_t name_sz;
 		char *name;
 
-		lg4ff_set_leds(hid, 0);
+		lg4ff_queue_leds(entry, 0);
 
 		name_sz = strlen(dev_name(&hid->dev)) + 8;
 
@@ -2273,6 +5287,285 @@ static void lg4ff_destroy(struct ff_device *ff)
 {
 }
 
+static void lg4ff_save_config(struct lg4ff_device_entry *entry, struct lg4ff_config *config)
+{
+	int i;
+
+	config->range = entry->wdata.range;
+	config->combine = entry->wdata.combine;
+	config->master_gain = entry->wdata.master_gain;
+	config->autocenter = entry->wdata.autocenter;
+	config->spring_level = entry->spring_level;
+	config->damper_level = entry->damper_level;
+	config->friction_level = entry->friction_level;
+	config->inertia_level = entry->inertia_level;
+	config->deadzone = entry->deadzone;
+	config->linearity = entry->linearity;
+	config->min_period = entry->rate.min_period;
+	config->hysteresis_time = entry->hysteresis_time;
+	for (i = 0; i < 4; i++) {
+		config->thresholds[i] = entry->slots[i].threshold;
+	}
+	config->timer_mode = entry->timer_mode;
+	config->fast_constant = entry->fast_constant;
+	config->hw_periodic = entry->hw_periodic;
+	config->smoothing = entry->smoothing;
+	config->dithering = entry->dithering;
+#ifdef CONFIG_LEDS_CLASS
+	config->ffb_leds = entry->ffb_leds;
+#endif
+}
+
+/* Apply a saved configuration to a device that has just been set up. The
+ * device commands are only queued, the control mailboxes send each of them
+ * once. */
+static void lg4ff_load_config(struct lg4ff_device_entry *entry, const struct lg4ff_config *config)
+{
+	struct hid_device *hid = entry->hid;
+	struct hid_input *hidinput = list_entry(hid->inputs.next, struct hid_input, list);
+	struct input_dev *dev = hidinput->input;
+	unsigned long flags;
+	int i;
+
+	if (config->range >= entry->wdata.min_range && config->range <= entry->wdata.max_range) {
+		if (entry->wdata.set_range) {
+			entry->wdata.set_range(hid, config->range);
+		}
+		entry->wdata.range = config->range;
+	}
+	entry->deadzone = config->deadzone;
+	entry->linearity = config->linearity;
+	lg4ff_update_curve(entry);
+	lg4ff_set_combine(entry, config->combine);
+
+	entry->wdata.master_gain = config->master_gain;
+	if (test_bit(FF_AUTOCENTER, dev->ffbit)) {
+		dev->ff->set_autocenter(dev, config->autocenter);
+	}
+	entry->spring_level = config->spring_level;
+	entry->damper_level = config->damper_level;
+	entry->friction_level = config->friction_level;
+	entry->inertia_level = config->inertia_level;
+	lg4ff_update_scale(entry);
+
+	spin_lock_irqsave(&entry->timer_lock, flags);
+	entry->timer_mode = config->timer_mode;
+	lg4ff_set_timer_period(entry, config->min_period);
+	spin_unlock_irqrestore(&entry->timer_lock, flags);
+	entry->hysteresis_time = config->hysteresis_time;
+	for (i = 0; i < 4; i++) {
+		entry->slots[i].threshold = config->thresholds[i];
+	}
+	entry->fast_constant = config->fast_constant;
+	entry->hw_periodic = config->hw_periodic && fixed_loop;
+	entry->smoothing = config->smoothing;
+	entry->dithering = config->dithering;
+#ifdef CONFIG_LEDS_CLASS
+	if (entry->has_leds) {
+		entry->ffb_leds = config->ffb_leds;
+	}
+#endif
+}
+
+/* Wheels are told apart by their serial number, or by the port they're
+ * plugged in when they don't report one */
+static const char *lg4ff_config_key(struct hid_device *hid)
+{
+	return hid->uniq[0] ? hid->uniq : hid->phys;
+}
+
+static struct lg4ff_saved_config *lg4ff_find_saved_config(struct lg4ff_device_entry *entry)
+{
+	const char *key = lg4ff_config_key(entry->hid);
+	int i;
+
+	for (i = 0; i < LG4FF_SAVED_CONFIGS; i++) {
+		if (lg4ff_saved_configs[i].serial
+				&& lg4ff_saved_configs[i].real_product_id == entry->wdata.real_product_id
+				&& !strcmp(lg4ff_saved_configs[i].key, key)) {
+			return &lg4ff_saved_configs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void lg4ff_store_config(struct lg4ff_device_entry *entry)
+{
+	struct lg4ff_saved_config *saved;
+	int i;
+
+	mutex_lock(&lg4ff_saved_mutex);
+	saved = lg4ff_find_saved_config(entry);
+	if (!saved) {
+		saved = &lg4ff_saved_configs[0];
+		for (i = 1; i < LG4FF_SAVED_CONFIGS; i++) {
+			if (lg4ff_saved_configs[i].serial < saved->serial) {
+				saved = &lg4ff_saved_configs[i];
+			}
+		}
+		strscpy(saved->key, lg4ff_config_key(entry->hid), sizeof(saved->key));
+		saved->real_product_id = entry->wdata.real_product_id;
+	}
+	saved->serial = ++lg4ff_saved_serial;
+	lg4ff_save_config(entry, &saved->config);
+	mutex_unlock(&lg4ff_saved_mutex);
+}
+
+static void lg4ff_restore_config(struct lg4ff_device_entry *entry)
+{
+	struct lg4ff_saved_config *saved;
+
+	mutex_lock(&lg4ff_saved_mutex);
+	saved = lg4ff_find_saved_config(entry);
+	if (saved) {
+		lg4ff_load_config(entry, &saved->config);
+		dbg_hid("Restored the settings of %s\n", saved->key);
+	}
+	mutex_unlock(&lg4ff_saved_mutex);
+}
+
+/* The device may have lost every setting while suspended, queue them all
+ * again and send them with the slots in one go */
+int lg4ff_resume(struct hid_device *hid)
+{
+	struct lg_drv_data *drv_data = hid_get_drvdata(hid);
+	struct lg4ff_device_entry *entry = drv_data->device_props;
+	struct hid_input *hidinput;
+	struct input_dev *dev;
+	unsigned long flags;
+
+	if (!entry) {
+		return 0;
+	}
+	hidinput = list_entry(hid->inputs.next, struct hid_input, list);
+	dev = hidinput->input;
+
+	lg4ff_send_loop_mode(entry);
+	if (entry->wdata.set_range) {
+		entry->wdata.set_range(hid, entry->wdata.range);
+	}
+	if (test_bit(FF_AUTOCENTER, dev->ffbit)) {
+		dev->ff->set_autocenter(dev, entry->wdata.autocenter);
+	}
+#ifdef CONFIG_LEDS_CLASS
+	if (entry->has_leds) {
+		lg4ff_queue_leds(entry, entry->ffb_leds ? entry->leds_meter.state : entry->wdata.led_state);
+	}
+#endif
+	cancel_delayed_work_sync(&entry->control_work);
+	lg4ff_send_controls(entry, LG4FF_CTRL_COUNT);
+
+	spin_lock_irqsave(&entry->timer_lock, flags);
+	lg4ff_resend_slots(entry);
+	if (lg4ff_output_pending(entry) && !lg4ff_timer_active(entry)) {
+		lg4ff_start_timer(entry);
+	}
+	spin_unlock_irqrestore(&entry->timer_lock, flags);
+
+	return 0;
+}
+
+/* Registering the leds takes a while and nothing else depends on them */
+static void lg4ff_init_work(struct work_struct *work)
+{
+#ifdef CONFIG_LEDS_CLASS
+	struct lg4ff_device_entry *entry = container_of(work, struct lg4ff_device_entry, init_work);
+
+	if (entry->has_leds) {
+		lg4ff_init_leds(entry->hid, entry);
+	}
+#endif
+}
+
+static struct attribute *lg4ff_attrs[] = {
+	&dev_attr_combine_pedals.attr,
+	&dev_attr_range.attr,
+	&dev_attr_deadzone.attr,
+	&dev_attr_linearity.attr,
+	&dev_attr_real_id.attr,
+	&dev_attr_alternate_modes.attr,
+	&dev_attr_gain.attr,
+	&dev_attr_autocenter.attr,
+	&dev_attr_peak_ffb_level.attr,
+	&dev_attr_timer_stats.attr,
+	&dev_attr_timer_usecs.attr,
+	&dev_attr_timer_mode.attr,
+	&dev_attr_fast_constant.attr,
+	&dev_attr_hw_periodic.attr,
+	&dev_attr_smoothing.attr,
+	&dev_attr_dithering.attr,
+	&dev_attr_hysteresis.attr,
+	&dev_attr_hysteresis_usecs.attr,
+	&dev_attr_spring_level.attr,
+	&dev_attr_damper_level.attr,
+	&dev_attr_friction_level.attr,
+	&dev_attr_inertia_level.attr,
+#ifdef CONFIG_LEDS_CLASS
+	&dev_attr_ffb_leds.attr,
+#endif
+	NULL
+};
+
+/* Only show the entries that apply to the wheel */
+static umode_t lg4ff_attr_is_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	struct hid_device *hid = to_hid_device(kobj_to_dev(kobj));
+	struct hid_input *hidinput = list_entry(hid->inputs.next, struct hid_input, list);
+	struct input_dev *dev = hidinput->input;
+	struct lg4ff_device_entry *entry;
+
+	entry = lg4ff_get_device_entry(hid);
+	if (entry == NULL) {
+		return 0;
+	}
+
+	/* Multimode devices will have at least the "MODE_NATIVE" bit set */
+	if (attr == &dev_attr_real_id.attr || attr == &dev_attr_alternate_modes.attr) {
+		return entry->wdata.alternate_modes ? attr->mode : 0;
+	}
+
+	if (attr == &dev_attr_combine_pedals.attr || attr == &dev_attr_range.attr
+			|| attr == &dev_attr_deadzone.attr || attr == &dev_attr_linearity.attr) {
+		return attr->mode;
+	}
+
+#ifdef CONFIG_LEDS_CLASS
+	if (attr == &dev_attr_ffb_leds.attr) {
+		return entry->has_leds ? attr->mode : 0;
+	}
+#endif
+
+	/* The rest are force feedback settings */
+	if (!test_bit(FF_CONSTANT, dev->ffbit)) {
+		return 0;
+	}
+
+	if (attr == &dev_attr_autocenter.attr) {
+		return test_bit(FF_AUTOCENTER, dev->ffbit) ? attr->mode : 0;
+	}
+	if (attr == &dev_attr_spring_level.attr) {
+		return test_bit(FF_SPRING, dev->ffbit) ? attr->mode : 0;
+	}
+	if (attr == &dev_attr_damper_level.attr) {
+		return test_bit(FF_DAMPER, dev->ffbit) ? attr->mode : 0;
+	}
+	if (attr == &dev_attr_friction_level.attr) {
+		return test_bit(FF_FRICTION, dev->ffbit)
+			&& (entry->wdata.capabilities & LG4FF_CAP_FRICTION) ? attr->mode : 0;
+	}
+	if (attr == &dev_attr_inertia_level.attr) {
+		return test_bit(FF_INERTIA, dev->ffbit) ? attr->mode : 0;
+	}
+
+	return attr->mode;
+}
+
+static const struct attribute_group lg4ff_attr_group = {
+	.attrs = lg4ff_attrs,
+	.is_visible = lg4ff_attr_is_visible,
+};
+
 int lg4ff_init(struct hid_device *hid)
 {
 	struct hid_input *hidinput;
@@ -2310,8 +5603,18 @@ int lg4ff_init(struct hid_device *hid)
 		return -ENOMEM;
 
 	spin_lock_init(&entry->report_lock);
+	spin_lock_init(&entry->timer_lock);
+	spin_lock_init(&entry->control_lock);
+	mutex_init(&entry->curve_mutex);
+	INIT_DELAYED_WORK(&entry->control_work, lg4ff_control_work);
+	INIT_WORK(&entry->init_work, lg4ff_init_work);
+	seqcount_init(&entry->motion.seq);
 	entry->hid = hid;
 	entry->report = report;
+	lg4ff_init_output(entry);
+	lg4ff_init_rate(entry);
+	/* Controls queued from here on check the timer */
+	lg4ff_init_timer(entry);
 	drv_data->device_props = entry;
 
 	/* Check if a multimode wheel has been connected and
@@ -2346,6 +5649,9 @@ int lg4ff_init(struct hid_device *hid)
 		goto err_init;
 	}
 
+	/* The device is staying in this mode, start from a known slot state */
+	lg4ff_init_slots(entry);
+
 	if (mmode_ret == LG4FF_MMODE_IS_MULTIMODE) {
 		for (mmode_idx = 0; mmode_idx < ARRAY_SIZE(lg4ff_multimode_wheels); mmode_idx++) {
 			if (real_product_id == lg4ff_multimode_wheels[mmode_idx].product_id)
@@ -2363,7 +5669,9 @@ int lg4ff_init(struct hid_device *hid)
 	for (j = 0; lg4ff_devices[i].ff_effects[j] >= 0; j++)
 		set_bit(lg4ff_devices[i].ff_effects[j], dev->ffbit);
 
-	error = input_ff_create(dev, LG4FF_MAX_EFFECTS);
+	lg4ff_init_wave_tables();
+
+	error = input_ff_create(dev, clamp(max_effects, 1, LG4FF_MAX_EFFECTS));
 
 	//__clear_bit(FF_RUMBLE, dev->ffbit);
 
@@ -2382,6 +5690,8 @@ int lg4ff_init(struct hid_device *hid)
 		mmode_wheel = &lg4ff_multimode_wheels[mmode_idx];
 	}
 	lg4ff_init_wheel_data(&entry->wdata, &lg4ff_devices[i], mmode_wheel, real_product_id);
+	entry->deadzone = 0;
+	entry->linearity = 100;
 
 	set_bit(FF_GAIN, dev->ffbit);
 
@@ -2403,90 +5713,58 @@ int lg4ff_init(struct hid_device *hid)
 			lg4ff_devices[i].product_id == USB_DEVICE_ID_LOGITECH_G29_WHEEL ||
 			lg4ff_devices[i].product_id == USB_DEVICE_ID_LOGITECH_G923_WHEEL) {
 		entry->has_leds = 1;
-		lg4ff_init_leds(hid, entry, i);
-	} else {
-		ffb_leds = 0;
+		entry->ffb_leds = ffb_leds ? 1 : 0;
 	}
 #endif
 
-	/* Create sysfs interface */
-	error = device_create_file(&hid->dev, &dev_attr_combine_pedals);
-	if (error)
-		hid_warn(hid, "Unable to create sysfs interface for \"combine\", errno %d\n", error);
-	error = device_create_file(&hid->dev, &dev_attr_range);
-	if (error)
-		hid_warn(hid, "Unable to create sysfs interface for \"range\", errno %d\n", error);
-	if (mmode_ret == LG4FF_MMODE_IS_MULTIMODE) {
-		error = device_create_file(&hid->dev, &dev_attr_real_id);
-		if (error)
-			hid_warn(hid, "Unable to create sysfs interface for \"real_id\", errno %d\n", error);
-		error = device_create_file(&hid->dev, &dev_attr_alternate_modes);
-		if (error)
-			hid_warn(hid, "Unable to create sysfs interface for \"alternate_modes\", errno %d\n", error);
-	}
-
-	if (test_bit(FF_CONSTANT, dev->ffbit)) {
-		error = device_create_file(&hid->dev, &dev_attr_gain);
-		if (error)
-			hid_warn(hid, "Unable to create sysfs interface for \"gain\", errno %d\n", error);
-		if (test_bit(FF_AUTOCENTER, dev->ffbit)) {
-			error = device_create_file(&hid->dev, &dev_attr_autocenter);
-			if (error)
-				hid_warn(hid, "Unable to create sysfs interface for \"autocenter\", errno %d\n", error);
-		}
-		error = device_create_file(&hid->dev, &dev_attr_peak_ffb_level);
-		if (error)
-			hid_warn(hid, "Unable to create sysfs interface for \"peak_ffb_level\", errno %d\n", error);
-		if (test_bit(FF_SPRING, dev->ffbit)) {
-			error = device_create_file(&hid->dev, &dev_attr_spring_level);
-			if (error)
-				hid_warn(hid, "Unable to create sysfs interface for \"spring_level\", errno %d\n", error);
-		}
-		if (test_bit(FF_DAMPER, dev->ffbit)) {
-			error = device_create_file(&hid->dev, &dev_attr_damper_level);
-			if (error)
-				hid_warn(hid, "Unable to create sysfs interface for \"damper_level\", errno %d\n", error);
-		}
-		if (test_bit(FF_FRICTION, dev->ffbit) && (entry->wdata.capabilities & LG4FF_CAP_FRICTION)) {
-			error = device_create_file(&hid->dev, &dev_attr_friction_level);
-			if (error)
-				hid_warn(hid, "Unable to create sysfs interface for \"friction_level\", errno %d\n", error);
-		}
-	}
-
-#ifdef CONFIG_LEDS_CLASS
-	if (entry->has_leds) {
-		error = device_create_file(&hid->dev, &dev_attr_ffb_leds);
-		if (error)
-			hid_warn(hid, "Unable to create sysfs interface for \"ffb_leds\", errno %d\n", error);
-	}
+#ifdef CONFIG_DEBUG_FS
+	lg4ff_init_debugfs(entry);
 #endif
 
-	dbg_hid("sysfs interface created\n");
-
 	/* Set the maximum range to start with */
 	entry->wdata.range = entry->wdata.max_range;
 	if (entry->wdata.set_range)
 		entry->wdata.set_range(hid, entry->wdata.range);
-
-	lg4ff_init_slots(entry);
+	lg4ff_update_curve(entry);
 
 	entry->effects_used = 0;
+	entry->timer_mode = timer_mode;
+	entry->fast_constant = fast_constant ? 1 : 0;
+	entry->hw_periodic = hw_periodic && fixed_loop ? 1 : 0;
+	entry->smoothing = smoothing ? 1 : 0;
+	entry->dithering = dithering ? 1 : 0;
+	entry->hysteresis_time = DEFAULT_HYSTERESIS_TIME;
+	entry->spring_level = clamp(spring_level, 0, 100);
+	entry->damper_level = clamp(damper_level, 0, 100);
+	entry->friction_level = clamp(friction_level, 0, 100);
+	entry->inertia_level = clamp(inertia_level, 0, 100);
 	entry->wdata.master_gain = 0xffff;
 	entry->wdata.gain = 0xffff;
+	lg4ff_build_scale(entry);
 
-	spin_lock_init(&entry->timer_lock);
+	lg4ff_sched_add(entry);
+
+	/* Bring back the settings of this wheel if it was connected before */
+	lg4ff_restore_config(entry);
+
+	/* Create sysfs interface */
+	error = sysfs_create_group(&hid->dev.kobj, &lg4ff_attr_group);
+	if (error)
+		hid_warn(hid, "Unable to create sysfs interface, errno %d\n", error);
+	dbg_hid("sysfs interface created\n");
 
-	hrtimer_init(&entry->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	entry->hrtimer.function = lg4ff_timer_hires;
+	schedule_work(&entry->init_work);
 
 	hid_info(hid, "Force feedback support for Logitech Gaming Wheels (%s)\n", LG4FF_VERSION);
 
-	hid_info(hid, "Hires timer: period = %d ms", timer_msecs);
+	hid_info(hid, "Hires timer: period = %u us", entry->rate.period);
 
 	return 0;
 
 err_init:
+	lg4ff_stop_timer(entry);
+	cancel_delayed_work_sync(&entry->control_work);
+	lg4ff_free_output(entry);
 	drv_data->device_props = NULL;
 	kfree(entry);
 	return error;
@@ -2494,8 +5772,6 @@ err_init:
 
 int lg4ff_deinit(struct hid_device *hid)
 {
-	struct hid_input *hidinput = list_entry(hid->inputs.next, struct hid_input, list);
-	struct input_dev *dev = hidinput->input;
 	struct lg4ff_device_entry *entry;
 	struct lg_drv_data *drv_data;
 
@@ -2508,34 +5784,22 @@ int lg4ff_deinit(struct hid_device *hid)
 	if (!entry)
 		goto out; /* Nothing more to do */
 
-	hrtimer_cancel(&entry->hrtimer);
+	lg4ff_store_config(entry);
 
-	/* Multimode devices will have at least the "MODE_NATIVE" bit set */
-	if (entry->wdata.alternate_modes) {
-		device_remove_file(&hid->dev, &dev_attr_real_id);
-		device_remove_file(&hid->dev, &dev_attr_alternate_modes);
-	}
+	lg4ff_stop_timer(entry);
+	lg4ff_sched_remove(entry);
 
-	device_remove_file(&hid->dev, &dev_attr_combine_pedals);
-	device_remove_file(&hid->dev, &dev_attr_range);
+#ifdef CONFIG_DEBUG_FS
+	debugfs_remove_recursive(entry->debug_dir);
+	spin_lock_irq(&entry->capture.lock);
+	entry->capture.active = 0;
+	spin_unlock_irq(&entry->capture.lock);
+	vfree(entry->capture.records);
+	vfree(entry->telemetry);
+#endif
 
-	if (test_bit(FF_CONSTANT, dev->ffbit)) {
-		device_remove_file(&hid->dev, &dev_attr_gain);
-		if (test_bit(FF_AUTOCENTER, dev->ffbit)) {
-			device_remove_file(&hid->dev, &dev_attr_autocenter);
-		}
-		device_remove_file(&hid->dev, &dev_attr_peak_ffb_level);
-		if (test_bit(FF_SPRING, dev->ffbit)) {
-			device_remove_file(&hid->dev, &dev_attr_spring_level);
-		}
-		if (test_bit(FF_DAMPER, dev->ffbit)) {
-			device_remove_file(&hid->dev, &dev_attr_damper_level);
-		}
-		if (test_bit(FF_FRICTION, dev->ffbit)
-				&& (entry->wdata.capabilities & LG4FF_CAP_FRICTION)) {
-			device_remove_file(&hid->dev, &dev_attr_friction_level);
-		}
-	}
+	sysfs_remove_group(&hid->dev.kobj, &lg4ff_attr_group);
+	cancel_work_sync(&entry->init_work);
 
 	lg4ff_stop_effects(entry);
 
@@ -2544,8 +5808,6 @@ int lg4ff_deinit(struct hid_device *hid)
 		int j;
 		struct led_classdev *led;
 
-		device_remove_file(&hid->dev, &dev_attr_ffb_leds);
-
 		/* Deregister LEDs (if any) */
 		for (j = 0; j < 5; j++) {
 
@@ -2559,6 +5821,14 @@ int lg4ff_deinit(struct hid_device *hid)
 	}
 #endif
 
+	/* Send the settings still queued through usbhid and let them go out,
+	 * the output reports are about to be poisoned */
+	cancel_delayed_work_sync(&entry->control_work);
+	entry->output.enabled = 0;
+	lg4ff_send_controls(entry, LG4FF_CTRL_COUNT);
+	hid_hw_wait(hid);
+	lg4ff_free_output(entry);
+
 	drv_data->device_props = NULL;
 
 	kfree(entry);
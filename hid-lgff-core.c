@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *  Rate limited output for the Logitech memless force feedback backends
+ */
+
+#include <linux/module.h>
+#include <linux/input.h>
+#include <linux/hid.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+
+#include "usbhid/usbhid.h"
+#include "hid-lg.h"
+#include "hid-lgff-core.h"
+
+static int lgff_msecs = 2;
+module_param(lgff_msecs, int, 0660);
+MODULE_PARM_DESC(lgff_msecs, "Minimum time between force feedback reports of the joysticks, rumble pads and older wheels in msecs.");
+
+/* Only USB devices have an output queue to look at, others count as idle */
+static __always_inline int lgff_core_busy(struct lgff_core *core)
+{
+	struct usbhid_device *usbhid;
+
+	if (!hid_is_usb(core->hid)) {
+		return 0;
+	}
+
+	usbhid = core->hid->driver_data;
+
+	return usbhid->outhead != usbhid->outtail;
+}
+
+/* Send the pending reports while the USB queue has room. Returns whether
+ * any is left. Must be called with the lock held. */
+static int lgff_core_flush(struct lgff_core *core)
+{
+	struct lgff_core_channel *channel;
+	int i;
+
+	for (i = 0; i < LGFF_CORE_CHANNELS; i++) {
+		channel = &core->channels[i];
+		if (!channel->pending) {
+			continue;
+		}
+		if (lgff_core_busy(core)) {
+			return 1;
+		}
+		memcpy(core->report->field[0]->value, channel->next, core->count * sizeof(s32));
+		memcpy(channel->last, channel->next, core->count * sizeof(s32));
+		channel->has_last = 1;
+		channel->pending = 0;
+		hid_hw_request(core->hid, core->report, HID_REQ_SET_REPORT);
+		core->sent_at = ktime_get();
+	}
+
+	return 0;
+}
+
+static enum hrtimer_restart lgff_core_timer(struct hrtimer *t)
+{
+	struct lgff_core *core = container_of(t, struct lgff_core, hrtimer);
+	unsigned long flags;
+	int armed;
+
+	spin_lock_irqsave(&core->lock, flags);
+	armed = !core->stopped && lgff_core_flush(core);
+	if (armed) {
+		hrtimer_forward_now(t, us_to_ktime(core->period));
+	}
+	core->armed = armed;
+	spin_unlock_irqrestore(&core->lock, flags);
+
+	return armed ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+void lgff_core_submit(struct lgff_core *core, int kind, const s32 *values)
+{
+	struct lgff_core_channel *channel = &core->channels[kind];
+	unsigned long flags;
+	ktime_t now;
+
+	spin_lock_irqsave(&core->lock, flags);
+
+	if (core->stopped) {
+		goto out;
+	}
+
+	memcpy(channel->next, values, core->count * sizeof(s32));
+	channel->pending = !channel->has_last ||
+		memcmp(channel->next, channel->last, core->count * sizeof(s32));
+
+	if (!channel->pending || core->armed) {
+		goto out;
+	}
+
+	now = ktime_get();
+	if (ktime_us_delta(now, core->sent_at) >= core->period && !lgff_core_flush(core)) {
+		goto out;
+	}
+
+	core->armed = 1;
+	hrtimer_start(&core->hrtimer, ktime_add_us(core->sent_at, core->period), HRTIMER_MODE_ABS);
+
+out:
+	spin_unlock_irqrestore(&core->lock, flags);
+}
+
+void lgff_core_init(struct lgff_core *core, struct hid_device *hid, struct hid_report *report)
+{
+	struct lg_drv_data *drv_data = hid_get_drvdata(hid);
+
+	core->hid = hid;
+	core->report = report;
+	core->count = min_t(unsigned int, report->field[0]->report_count, LGFF_CORE_VALUES);
+	core->period = clamp(lgff_msecs, 1, 100) * 1000;
+	spin_lock_init(&core->lock);
+	hrtimer_init(&core->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	core->hrtimer.function = lgff_core_timer;
+
+	drv_data->device_props = core;
+}
+
+/* The core is freed along with the memless device, only stop using the HID
+ * device here. */
+void lgff_core_stop(struct hid_device *hid)
+{
+	struct lg_drv_data *drv_data = hid_get_drvdata(hid);
+	struct lgff_core *core = drv_data->device_props;
+	unsigned long flags;
+
+	if (!core) {
+		return;
+	}
+
+	spin_lock_irqsave(&core->lock, flags);
+	core->stopped = 1;
+	spin_unlock_irqrestore(&core->lock, flags);
+
+	hrtimer_cancel(&core->hrtimer);
+	drv_data->device_props = NULL;
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __HID_LGFF_CORE_H
+#define __HID_LGFF_CORE_H
+
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+
+#define LGFF_CORE_VALUES	64	/* Values of the output field handled */
+
+/* Kinds of reports, each one only replaces reports of its own kind */
+#define LGFF_CORE_EFFECT	0
+#define LGFF_CORE_SETTING	1
+#define LGFF_CORE_CHANNELS	2
+
+struct lgff_core_channel {
+	s32 next[LGFF_CORE_VALUES];	/* Waiting to be sent */
+	s32 last[LGFF_CORE_VALUES];	/* Last sent to the device */
+	int has_last;
+	int pending;
+};
+
+/* Output stage shared by the memless backends. Reports are sent right away
+ * when the device is idle, otherwise only the latest one of each kind is
+ * sent once the period since the last report is over and the USB queue has
+ * room. Reports equal to the last one sent are dropped. */
+struct lgff_core {
+	struct hid_device *hid;
+	struct hid_report *report;
+	spinlock_t lock;	/* Protect the channels and the report */
+	struct hrtimer hrtimer;
+	ktime_t sent_at;
+	unsigned int period;	/* Minimum time between reports in us */
+	unsigned int count;	/* Values copied into the report */
+	int armed;
+	int stopped;
+	struct lgff_core_channel channels[LGFF_CORE_CHANNELS];
+};
+
+void lgff_core_init(struct lgff_core *core, struct hid_device *hid, struct hid_report *report);
+void lgff_core_submit(struct lgff_core *core, int kind, const s32 *values);
+
+#endif
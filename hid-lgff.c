@@ -18,9 +18,11 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/input.h>
+#include <linux/slab.h>
 #include <linux/hid.h>
 
 #include "hid-lg.h"
+#include "hid-lgff-core.h"
 
 struct dev_type {
 	u16 idVendor;
@@ -56,9 +58,8 @@ static const struct dev_type devices[] = {
 
 static int hid_lgff_play(struct input_dev *dev, void *data, struct ff_effect *effect)
 {
-	struct hid_device *hid = input_get_drvdata(dev);
-	struct list_head *report_list = &hid->report_enum[HID_OUTPUT_REPORT].report_list;
-	struct hid_report *report = list_entry(report_list->next, struct hid_report, list);
+	struct lgff_core *core = data;
+	s32 value[LGFF_CORE_VALUES] = { 0 };
 	int x, y;
 	unsigned int left, right;
 
@@ -70,12 +71,12 @@ static int hid_lgff_play(struct input_dev *dev, void *data, struct ff_effect *ef
 		y = effect->u.ramp.end_level + 0x7f;
 		CLAMP(x);
 		CLAMP(y);
-		report->field[0]->value[0] = 0x51;
-		report->field[0]->value[1] = 0x08;
-		report->field[0]->value[2] = x;
-		report->field[0]->value[3] = y;
+		value[0] = 0x51;
+		value[1] = 0x08;
+		value[2] = x;
+		value[3] = y;
 		dbg_hid("(x, y)=(%04x, %04x)\n", x, y);
-		hid_hw_request(hid, report, HID_REQ_SET_REPORT);
+		lgff_core_submit(core, LGFF_CORE_EFFECT, value);
 		break;
 
 	case FF_RUMBLE:
@@ -85,12 +86,12 @@ static int hid_lgff_play(struct input_dev *dev, void *data, struct ff_effect *ef
 		left = left * 0xff / 0xffff;
 		CLAMP(left);
 		CLAMP(right);
-		report->field[0]->value[0] = 0x42;
-		report->field[0]->value[1] = 0x00;
-		report->field[0]->value[2] = left;
-		report->field[0]->value[3] = right;
+		value[0] = 0x42;
+		value[1] = 0x00;
+		value[2] = left;
+		value[3] = right;
 		dbg_hid("(left, right)=(%04x, %04x)\n", left, right);
-		hid_hw_request(hid, report, HID_REQ_SET_REPORT);
+		lgff_core_submit(core, LGFF_CORE_EFFECT, value);
 		break;
 	}
 	return 0;
@@ -99,9 +100,14 @@ static int hid_lgff_play(struct input_dev *dev, void *data, struct ff_effect *ef
 static void hid_lgff_set_autocenter(struct input_dev *dev, u16 magnitude)
 {
 	struct hid_device *hid = input_get_drvdata(dev);
-	struct list_head *report_list = &hid->report_enum[HID_OUTPUT_REPORT].report_list;
-	struct hid_report *report = list_entry(report_list->next, struct hid_report, list);
-	__s32 *value = report->field[0]->value;
+	struct lg_drv_data *drv_data = hid_get_drvdata(hid);
+	struct lgff_core *core = drv_data->device_props;
+	s32 values[LGFF_CORE_VALUES] = { 0 };
+	s32 *value = values;
+
+	if (!core)
+		return;
+
 	magnitude = (magnitude >> 12) & 0xf;
 	*value++ = 0xfe;
 	*value++ = 0x0d;
@@ -110,11 +116,13 @@ static void hid_lgff_set_autocenter(struct input_dev *dev, u16 magnitude)
 	*value++ = 0x80;
 	*value++ = 0x00;
 	*value = 0x00;
-	hid_hw_request(hid, report, HID_REQ_SET_REPORT);
+	lgff_core_submit(core, LGFF_CORE_SETTING, values);
 }
 
 int lgff_init(struct hid_device* hid)
 {
+	struct lgff_core *core;
+	struct hid_report *report;
 	struct hid_input *hidinput;
 	struct input_dev *dev;
 	const signed short *ff_bits = ff_joystick;
@@ -129,7 +137,8 @@ int lgff_init(struct hid_device* hid)
 	dev = hidinput->input;
 
 	/* Check that the report looks ok */
-	if (!hid_validate_values(hid, HID_OUTPUT_REPORT, 0, 0, 7))
+	report = hid_validate_values(hid, HID_OUTPUT_REPORT, 0, 0, 7);
+	if (!report)
 		return -ENODEV;
 
 	for (i = 0; i < ARRAY_SIZE(devices); i++) {
@@ -143,9 +152,18 @@ int lgff_init(struct hid_device* hid)
 	for (i = 0; ff_bits[i] >= 0; i++)
 		set_bit(ff_bits[i], dev->ffbit);
 
-	error = input_ff_create_memless(dev, NULL, hid_lgff_play);
-	if (error)
+	core = kzalloc(sizeof(struct lgff_core), GFP_KERNEL);
+	if (!core)
+		return -ENOMEM;
+
+	lgff_core_init(core, hid, report);
+
+	error = input_ff_create_memless(dev, core, hid_lgff_play);
+	if (error) {
+		lgff_core_stop(hid);
+		kfree(core);
 		return error;
+	}
 
 	if ( test_bit(FF_AUTOCENTER, dev->ffbit) )
 		dev->ff->set_autocenter = hid_lgff_set_autocenter;